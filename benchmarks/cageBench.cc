@@ -0,0 +1,352 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+// Microbenchmarks for the client hot paths.
+//   usage: cageBench [iterations] [payload file]
+// The payload file holds one captured report message (json) per line. A
+// synthetic CommActor report is used when no file is given.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <new>
+#include <thread>
+
+#include "cageclient.hh"
+
+static std::atomic<uint64_t> sAllocs{0};
+
+// count every allocation made through operator new
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(size_t size) {
+  sAllocs.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+using benchClock = std::chrono::steady_clock;
+
+const char *sSampleReport =
+    "{\"Report\":{\"Name\":\"PuffinBP_2\",\"Time\":1234.567891,"
+    "\"Data\":{\"LeftRpm\":123.456789,\"RightRpm\":-123.456789,"
+    "\"Accel\":{\"X\":1.234567,\"Y\":-0.345678,\"Z\":980.665001},"
+    "\"AngVel\":{\"X\":0.012345,\"Y\":-0.023456,\"Z\":12.345678},"
+    "\"Pose\":{\"X\":0.001234,\"Y\":-0.002345,\"Z\":0.382683,\"W\":0.923879},"
+    "\"Position\":{\"X\":12345.678,\"Y\":-2345.6789,\"Z\":12.345678},"
+    "\"lat\":{\"X\":35,\"Y\":41,\"Z\":12.345678},"
+    "\"lon\":{\"X\":139,\"Y\":45,\"Z\":56.789012}}}}";
+
+struct result {
+  double ns;
+  double allocs;
+};
+
+// run f n times and report time and allocations per call
+template <typename F>
+result measure(int n, F f) {
+  uint64_t a0 = sAllocs.load();
+  auto     t0 = benchClock::now();
+  for (int i = 0; i < n; ++i) f(i);
+  auto     t1 = benchClock::now();
+  uint64_t a1 = sAllocs.load();
+  return {std::chrono::duration<double, std::nano>(t1 - t0).count() / n,
+          static_cast<double>(a1 - a0) / n};
+}
+
+void print(const char *name, result r) {
+  std::cout << std::left << std::setw(36) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12) << r.ns << " ns/op"
+            << std::setprecision(2) << std::setw(10) << r.allocs
+            << " allocs/op" << std::endl;
+}
+
+volatile double sSink;
+
+// parse into a dom and look up the report fields as getStatusOne used to
+template <typename J>
+void benchDom(const char *name, const std::vector<std::string> &payloads,
+              int n) {
+  size_t k = payloads.size();
+  print(name, measure(n, [&](int i) {
+          const auto &p    = payloads[i % k];
+          J           j    = J::parse(p.begin(), p.end());
+          const J    &data = j["Report"]["Data"];
+          double      s    = j["Report"]["Time"].template get<double>();
+          for (const char *key : {"LeftRpm", "RightRpm"})
+            if (data.count(key)) s += data[key].template get<double>();
+          for (const char *key : {"Accel", "AngVel", "Position"})
+            if (data.count(key)) s += data[key]["X"].template get<double>();
+          sSink = s;
+        }));
+}
+
+void benchDecode(const std::vector<std::string> &payloads, int n) {
+  size_t k = payloads.size();
+  print("decode/json dom", measure(n, [&](int i) {
+          const auto            &p = payloads[i % k];
+          Json                   j = Json::parse(p.begin(), p.end());
+          reportFields           f;
+          CageAPI::vehicleStatus vst{};
+          reportDecoder::fromJson(j["Report"], f);
+          CageAPI::decodeStatus(f, vst);
+          sSink = vst.simClock;
+        }));
+  benchDom<JsonTree>("decode/dom lookups (map)", payloads, n);
+  benchDom<JsonFlat>("decode/dom lookups (flat)", payloads, n);
+  print("decode/streaming", measure(n, [&](int i) {
+          const auto            &p = payloads[i % k];
+          reportFields           f;
+          CageAPI::vehicleStatus vst{};
+          if (reportDecoder::decode(p.data(), p.size(), f))
+            CageAPI::decodeStatus(f, vst);
+          sSink = vst.simClock;
+        }));
+  // the same reports in the binary wire format
+  std::vector<std::string> binary;
+  for (const auto &p : payloads) {
+    reportFields f;
+    char         buf[1024];
+    if (!reportDecoder::decode(p.data(), p.size(), f)) continue;
+    binary.emplace_back(buf, reportDecoder::encodeBinary(f, buf, sizeof(buf)));
+  }
+  if (binary.size())
+    print("decode/binary", measure(n, [&](int i) {
+            const auto            &p = binary[i % binary.size()];
+            reportFields           f;
+            CageAPI::vehicleStatus vst{};
+            if (reportDecoder::decode(p.data(), p.size(), f))
+              CageAPI::decodeStatus(f, vst);
+            sSink = vst.simClock;
+          }));
+  print("decode/peek name", measure(n, [&](int i) {
+          const auto      &p = payloads[i % k];
+          std::string_view name;
+          reportDecoder::peekName(p.data(), p.size(), name);
+          sSink = name.size();
+        }));
+}
+
+void benchSubscriber(zmq::context_t                 &ctx,
+                     const std::vector<std::string> &payloads, int n) {
+  zmq::socket_t pub(ctx, ZMQ_PUB);
+  // inproc PUB accounts the HWM lazily and would drop now and then
+  int unlimited = 0;
+  pub.setsockopt(ZMQ_SNDHWM, unlimited);
+  pub.bind("inproc://bench-reporter");
+  simSubscriber sub(ctx, "inproc://bench-reporter");
+  sub.connect();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  size_t k = payloads.size();
+  auto   send = [&](int i) {
+    const auto &p = payloads[i % k];
+    pub.send(p.data(), p.size());
+  };
+  // publish and receive one by one: measures the receive path, not queueing
+  print("subscriber/recvOne (json)", measure(n, [&](int i) {
+          send(i);
+          Json j = sub.recvOne();
+          sSink  = j.size();
+        }));
+  print("subscriber/recvRaw+decode", measure(n, [&](int i) {
+          send(i);
+          zmq::message_t         msg;
+          reportFields           f;
+          CageAPI::vehicleStatus vst{};
+          sub.recvRaw(msg);
+          if (sub.filterReport(msg.data<char>(), msg.size()) &&
+              reportDecoder::decode(msg.data<char>(), msg.size(), f))
+            CageAPI::decodeStatus(f, vst);
+          sSink = vst.simClock;
+        }));
+  print("subscriber/recvView+decode", measure(n, [&](int i) {
+          send(i);
+          std::string_view       data;
+          reportFields           f;
+          CageAPI::vehicleStatus vst{};
+          sub.recvView(data);
+          if (sub.filterReport(data.data(), data.size()) &&
+              reportDecoder::decode(data.data(), data.size(), f))
+            CageAPI::decodeStatus(f, vst);
+          sSink = vst.simClock;
+        }));
+  print("  (transport only)", measure(n, [&](int i) {
+          send(i);
+          zmq::message_t msg;
+          sub.recvRaw(msg);
+        }));
+}
+
+void benchEncode(int n) {
+  print("encode/vwCommand", measure(n, [&](int i) {
+          sSink = CageAPI::vwCommand(0.01 * i, 0.1).size();
+        }));
+  commandEncoder enc;
+  print("encode/commandEncoder vw", measure(n, [&](int i) {
+          sSink = enc.vw(0.01 * i, 0.1).size();
+        }));
+  print("encode/actor message envelope", measure(n, [&](int) {
+          std::ostringstream os;
+          os << "{\n"
+             << "\"Type\" :  \"ActorMsg\",\n"
+             << "\"Endpoint\" : \"" << "PuffinBP_2" << "\"\n"
+             << "}";
+          sSink = os.str().size();
+        }));
+}
+
+// status history: push, and a mean over the newest samples read in place
+void benchHistory(int n) {
+  constexpr size_t       Window = 256;
+  statusRing             ring(4096);
+  CageAPI::vehicleStatus vst{};
+  print("history/push", measure(n, [&](int i) {
+          vst.simClock = i * 0.005;
+          vst.lrpm     = i & 0xff;
+          ring.push(vst);
+        }));
+  print("history/window mean (columns)", measure(n, [&](int) {
+          auto   w   = ring.last(Window);
+          double sum = 0;
+          for (double v : w.first(statusRing::LRPM)) sum += v;
+          for (double v : w.second(statusRing::LRPM)) sum += v;
+          sSink = sum / w.size();
+        }));
+}
+
+void benchRoundTrip(zmq::context_t &ctx, int n) {
+  // stand-in console: answers every request with a fixed result, batches
+  // with one per command
+  zmq::socket_t rep(ctx, ZMQ_REP);
+  rep.bind("inproc://bench-console");
+  std::thread server([&]() {
+    const std::string res = "{\"Result\":\"OK\"}";
+    std::string       batchRes;  // for batchSize commands
+    int               batchSize = -1;
+    zmq::message_t    msg;
+    for (;;) {
+      if (rep.recv(&msg) < 0) return;
+      bool stop  = msg.size() == 4 && memcmp(msg.data(), "stop", 4) == 0;
+      bool batch = msg.view() == simConsole::BatchRequest;
+      int  n     = 0;
+      for (; msg.more(); ++n) rep.recv(&msg);
+      if (batch && batchSize != n / 2) {
+        batchSize = n / 2;
+        batchRes  = "{\"Result\":[";
+        for (int i = 0; i < n / 2; ++i) batchRes += i ? ",\"OK\"" : "\"OK\"";
+        batchRes += "]}";
+      }
+      const std::string &r = batch ? batchRes : res;
+      rep.send(r.data(), r.size());
+      if (stop) return;
+    }
+  });
+  simConsole con(ctx, "inproc://bench-console");
+  con.connect();
+  std::vector<double> lat(n);
+  std::string_view    res;
+  auto                header = std::string(
+      "{\"Type\":\"ActorMsg\",\"Endpoint\":\"PuffinBP_2\"}");
+  auto r = measure(n, [&](int i) {
+    auto t0 = benchClock::now();
+    con.submitRequest(
+        std::vector<std::string>{header, CageAPI::vwCommand(0.01 * i, 0)},
+        res);
+    lat[i] =
+        std::chrono::duration<double, std::micro>(benchClock::now() - t0)
+            .count();
+  });
+  print("console/submitRequest round trip", r);
+  std::sort(lat.begin(), lat.end());
+  std::cout << "  latency us  p50: " << lat[n / 2]
+            << "  p99: " << lat[n * 99 / 100] << "  max: " << lat[n - 1]
+            << std::endl;
+  commandEncoder enc;
+  enc.bind("PuffinBP_2");
+  r = measure(n, [&](int i) {
+    enc.vw(0.01 * i, 0);
+    con.sendActorMessage(enc);
+  });
+  print("console/sendActorMessage (encoder)", r);
+
+  // one control tick of a fleet: per vehicle requests against one batch
+  const int                   fleet = 16;
+  std::vector<commandEncoder> encs(fleet);
+  std::vector<commandEncoder *> ptrs;
+  for (int v = 0; v < fleet; ++v) {
+    encs[v].bind("PuffinBP_" + std::to_string(v));
+    ptrs.push_back(&encs[v]);
+  }
+  int ticks = std::max(1, n / fleet);
+  r         = measure(ticks, [&](int i) {
+    for (auto &e : encs) {
+      e.vw(0.01 * i, 0);
+      con.sendActorMessage(e);
+    }
+  });
+  print("console/16 vehicles one by one", r);
+  r = measure(ticks, [&](int i) {
+    for (auto &e : encs) e.vw(0.01 * i, 0);
+    if (!con.sendActorMessages(ptrs.data(), ptrs.size()))
+      std::cerr << "batch failed: " << con.getLastError() << std::endl;
+  });
+  print("console/16 vehicles ActorMsgBatch", r);
+
+  // the same over simAsyncConsole, one request in flight at a time
+  simAsyncConsole async(ctx, "inproc://bench-console");
+  async.connect();
+  r = measure(n, [&](int i) {
+    enc.vw(0.01 * i, 0);
+    async.postActorMessage(enc);
+    async.wait(1000);
+  });
+  print("async/postActorMessage (encoder)", r);
+  r = measure(ticks, [&](int i) {
+    for (auto &e : encs) e.vw(0.01 * i, 0);
+    async.postActorMessages(ptrs.data(), ptrs.size());
+    async.wait(1000);
+  });
+  print("async/16 vehicles ActorMsgBatch", r);
+  con.submitRequest("stop", res);
+  server.join();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? std::max(1, atoi(argv[1])) : 100000;
+
+  std::vector<std::string> payloads;
+  if (argc > 2) {
+    std::ifstream in(argv[2]);
+    std::string   line;
+    while (std::getline(in, line))
+      if (line.size()) payloads.push_back(line);
+    if (payloads.empty()) {
+      std::cerr << "No payload found in " << argv[2] << std::endl;
+      return 1;
+    }
+  } else {
+    payloads.push_back(sSampleReport);
+  }
+  std::cout << "iterations: " << n << "  payloads: " << payloads.size()
+            << std::endl;
+
+  zmq::context_t ctx(1);
+  benchDecode(payloads, n);
+  benchSubscriber(ctx, payloads, n);
+  benchEncode(n);
+  benchHistory(n);
+  benchRoundTrip(ctx, std::max(1, n / 10));
+  return 0;
+}
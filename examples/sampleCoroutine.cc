@@ -0,0 +1,72 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+// Drives console RPCs and a status stream from one thread with coroutines.
+// Fetches the metadata of all vehicles concurrently, then prints reports
+// of the first vehicle for a few seconds.
+//   usage: sampleCoroutine [address]
+
+#include <iostream>
+
+#include "cagecoro.hh"
+
+cageTask<> inspect(cageReactor &reactor, coConsole &con) {
+  std::vector<std::string> names;
+  if (!co_await con.listEndpoints("Vehicle", names)) {
+    std::cerr << con.getLastError() << std::endl;
+    co_return;
+  }
+  // all requests are in flight at once
+  std::vector<Json>           metas(names.size());
+  std::vector<cageTask<bool>> requests;
+  for (size_t i = 0; i < names.size(); ++i)
+    requests.push_back(con.getActorMetadata(names[i], metas[i]));
+  co_await reactor.all(requests);
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!requests[i].result()) {
+      std::cerr << names[i] << ": " << con.getLastError() << std::endl;
+      continue;
+    }
+    CageAPI::vehicleInfo info;
+    CageAPI::parseVehicleInfo(names[i], metas[i], info);
+    std::cout << info.name << ": tread " << info.TreadWidth
+              << " m, reduction " << info.ReductionRatio << std::endl;
+  }
+}
+
+cageTask<> watch(coStatusStream &stream, int seconds) {
+  auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+  CageAPI::vehicleStatus vst;
+  int                    n = 0;
+  while (co_await stream.nextStatus(vst, end)) ++n;
+  std::cout << n << " reports in " << seconds << " s, last clock "
+            << vst.simClock << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  std::string addr = argc > 1 ? argv[1] : "127.0.0.1";
+
+  CageAPI cage(addr);
+  if (!cage.connect()) {
+    std::cerr << cage.getErrorString() << std::endl;
+    return 1;
+  }
+
+  zmq::context_t ctx(1);
+  cageReactor    reactor;
+  coConsole      con(reactor, ctx, "tcp://" + addr + ":54323");
+  if (!con.connect()) {
+    std::cerr << con.getLastError() << std::endl;
+    return 1;
+  }
+  coStatusStream stream(reactor, cage);
+
+  reactor.spawn(inspect(reactor, con));
+  reactor.spawn(watch(stream, 3));
+  reactor.run();
+  return 0;
+}
@@ -0,0 +1,62 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+// Runs mockCommActor on the default ports so that sampleRun etc. can be
+// tried without the simulator.
+//   usage: sampleMockServer [vehicles] [rate] [json|binary]
+// binary publishes reports in the binary wire format from the start;
+// clients may also switch it with CageAPI::setWireFormat.
+
+#include <signal.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "mockcommactor.hh"
+
+static bool sTerminated = false;
+
+void sig_handler(int) { sTerminated = true; }
+
+int main(int argc, char *argv[]) {
+  signal(SIGINT, sig_handler);
+
+  int         vehicles = argc > 1 ? std::max(1, atoi(argv[1])) : 1;
+  double      rate     = argc > 2 ? atof(argv[2]) : 100.;
+  std::string enc      = argc > 3 ? argv[3] : "json";
+  if (rate <= 0 || (enc != "json" && enc != "binary")) {
+    std::cout << "usage: sampleMockServer [vehicles] [rate] [json|binary]"
+              << std::endl;
+    return 1;
+  }
+
+  zmq::context_t ctx(1);
+  mockCommActor  mock(ctx);
+  for (int i = 0; i < vehicles; ++i)
+    mock.addVehicle("MockVehicle_" + std::to_string(i));
+  mock.setReportRate(rate);
+  mock.setBinaryReports(enc == "binary");
+  if (!mock.start()) {
+    std::cerr << mock.getLastError() << std::endl;
+    return 1;
+  }
+  std::cout << vehicles << " vehicle(s) reporting at " << rate << " Hz"
+            << std::endl;
+
+  uint64_t last = 0;
+  while (!sTerminated) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    const auto &st = mock.getStatistics();
+    std::cout << "reports/s: " << st.reports - last
+              << "  requests: " << st.requests
+              << "  commands: " << st.commands << std::endl;
+    last = st.reports;
+  }
+  mock.stop();
+  return 0;
+}
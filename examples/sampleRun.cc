@@ -5,7 +5,7 @@ http://opensource.org/licenses/mit-license.php
 */
 
 #include <signal.h>
-#include"cageclient.hh"
+#include"odometry.hh"
 
 static bool sTerminated = false;
 
@@ -31,15 +31,13 @@ int main(int argc, char* argv[]) {
 
   std::cout<<"connecting to: "<<server<<std::endl;
   cage.connect();
-  double odo = 0;
-  double simClock=0;
-  const double perimeter = (cage.VehicleInfo.WheelPerimeterL + cage.VehicleInfo.WheelPerimeterR)/2.;
+  wheelOdometry odo(cage.VehicleInfo);
 
   std::cout << "Waiting for message" << std::endl;
   { // initialize clock
     CageAPI::vehicleStatus vst;
     cage.getStatusOne(vst);
-    simClock=vst.simClock;
+    odo.update(vst);
   }
   // 0.2m/s
   cage.setVW(0.20,0);
@@ -50,20 +48,14 @@ int main(int argc, char* argv[]) {
     cage.poll();
     if(!cage.getStatusOne(vst))continue;
     std::cout << "------------------------" << std::endl;
-    double dt=vst.simClock-simClock;
-    simClock=vst.simClock;
-
-    // simple odometry (no rotation)
-    // rpm -> m/s
-    double dx = (vst.lrpm - vst.rrpm) /60. / 2.
-     /cage.VehicleInfo.ReductionRatio * perimeter * dt;
-    odo+=dx;
+    odo.update(vst);
+    const wheelOdometry::pose &p = odo.getPose();
 
     // 10[m] from start point
-    if(odo>10)
+    if(std::hypot(p.x, p.y)>10)
     break;
 
-    std::cout << "odo: " << odo << "  dt: " << dt << "  dx: " << dx << " rpmL:" << vst.lrpm << " rpmR:" << vst.rrpm << std::endl;
+    std::cout << "x: " << p.x << "  y: " << p.y << "  yaw: " << p.yaw << "  v: " << p.v << " rpmL:" << vst.lrpm << " rpmR:" << vst.rrpm << std::endl;
   }
   // stop
   cage.setVW(0,0);
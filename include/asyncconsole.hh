@@ -0,0 +1,413 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "console.hh"
+#include "zmq_nt.hpp"
+
+// Pipelined console client. Requests go out on a DEALER socket as
+// [request id][empty][frames...]; the console (REP, or ROUTER handling REQ
+// clients) echoes the envelope back, so replies are matched by id and
+// several requests can be in flight at once. Nothing here blocks unless a
+// timeout is given to dispatch().
+class simAsyncConsole {
+public:
+  // called from dispatch(). ok is false on timeout, when the request was
+  // superseded before being sent or when the socket failed; reply is empty
+  // then.
+  using handler =
+      std::function<void(uint64_t id, bool ok, const std::string &reply)>;
+
+  struct statistics {
+    uint64_t sent      = 0;
+    uint64_t acked     = 0;  // replies received
+    uint64_t coalesced = 0;  // replaced by a newer request before sending
+    uint64_t timedout  = 0;
+  };
+
+  simAsyncConsole(zmq::context_t &ctx,
+                  std::string     server = "tcp://127.0.0.1:54323");
+  ~simAsyncConsole() { close(); }
+  bool        connect();
+  void        close();
+  bool        isValid() { return Sock && Sock->isValid(); }
+  // ZMTP heartbeats (libzmq 4.2+): the connection is dropped and retried
+  // when the peer is silent for timeout_ms. must be set before connect()
+  bool        setHeartbeat(int ivl_ms, int timeout_ms);
+  std::string getLastError() { return lastErr; }
+
+  // queue a request; returns its id (never 0)
+  uint64_t submit(std::vector<std::string> frames, handler h = nullptr);
+  // queue an ActorMsg. A not yet sent message to the same endpoint is
+  // replaced, so only the newest setpoint goes out.
+  uint64_t postActorMessage(const std::string &endpoint, std::string command,
+                            handler h = nullptr);
+  // the same for the command last encoded by enc, sent without copying
+  // (see simConsole::sendActorMessage). The command goes out as encoded when
+  // the request is sent, so encoding again before that replaces it as well;
+  // keep enc alive until then.
+  uint64_t postActorMessage(commandEncoder &enc, handler h = nullptr);
+  // one ActorMsgBatch request (see simConsole::sendActorMessages) for the
+  // commands of n encoders, on the same terms. Never coalesced
+  uint64_t postActorMessages(commandEncoder *const *enc, size_t n,
+                             handler h = nullptr);
+  // simConsole requests with parsed replies. ok is false on timeout or an
+  // unexpected reply.
+  uint64_t listEndpoints(
+      const std::string                                          &tag,
+      std::function<void(bool ok, std::vector<std::string> &res)> h);
+  uint64_t getActorMetadata(const std::string                     &actor,
+                            std::function<void(bool ok, Json &res)> h);
+  // ask for another wire encoding (see wireformat.hh). ok is true if the
+  // console accepted it
+  uint64_t setEncoding(const std::string &name, std::function<void(bool ok)> h);
+  // send queued requests as the window allows and handle received replies.
+  // waits up to timeout_ms for a reply if nothing arrived. returns the number
+  // of replies handled, or -1 on socket error. A send failing part way
+  // through a request would leave half a message on the socket: the socket
+  // is closed then and everything queued or in flight fails, so a new
+  // simAsyncConsole is needed.
+  int dispatch(int timeout_ms = 0);
+  // dispatch until nothing is queued or in flight. false on timeout or
+  // socket error
+  bool wait(int timeout_ms);
+
+  // ZMQ_FD / ZMQ_EVENTS for external event loops; call dispatch() when the
+  // fd fires (see simSubscriber::getFd)
+  zmq::fd_t getFd() const { return Sock->getsockopt<zmq::fd_t>(ZMQ_FD); }
+  uint32_t  getEvents() const {
+    return Sock->getsockopt<uint32_t>(ZMQ_EVENTS);
+  }
+  // for zmq::poller_t together with other sockets; call dispatch() when it
+  // is readable
+  zmq::socket_t &getSocket() { return *Sock; }
+
+  size_t            inFlight() const { return InFlight.size(); }
+  size_t            queued() const { return Queue.size(); }
+  void              setWindow(size_t n) { Window = n ? n : 1; }
+  void              setReplyTimeout(int ms) { ReplyTimeout = ms; }
+  const statistics &getStatistics() const { return Stats; }
+  // time sends (SEND) and replies (REPLY, until dispatch() takes them) into
+  // stats; nullptr stops
+  void              setLatencyStats(latencyStats *stats) { Latency = stats; }
+
+protected:
+  using clock = std::chrono::steady_clock;
+  struct request {
+    uint64_t                      id;
+    std::string                   key;  // coalescing key (endpoint), or empty
+    std::vector<std::string>      frames;
+    handler                       done;
+    clock::time_point             sentAt;
+    // [envelope][command] pairs sent after frames, without copying
+    commandEncoder               *encoder = nullptr;  // keyed by its endpoint
+    std::vector<commandEncoder *> encoders;
+  };
+
+  std::unique_ptr<zmq::socket_t> Sock;
+  std::string                    Server;
+  std::string                    lastErr;
+  // vectors: short, and they keep their storage, so that steady traffic
+  // does not allocate
+  std::vector<request>           Queue;     // not sent yet
+  std::vector<request>           InFlight;  // waiting for replies
+  uint64_t                       NextId       = 1;
+  size_t                         Window       = 4;
+  int                            ReplyTimeout = 1000;  // [ms]
+  statistics                     Stats;
+  latencyStats                  *Latency = nullptr;
+
+  // r.id is assigned here
+  uint64_t enqueue(request r);
+  static std::string_view keyOf(const request &r) {
+    return r.encoder ? std::string_view(r.encoder->getEndpoint())
+                     : std::string_view(r.key);
+  }
+  // 1: sent, 0: not sent (retry on next dispatch), -1: failed after the
+  // first frame
+  int      sendOne(request &r);
+  // close the socket and fail all queued and in flight requests
+  void     failAll();
+  // 1: got a reply, 0: nothing to read, -1: socket error
+  int      recvOne(uint64_t &id, std::string &reply);
+  void     expire();
+};
+
+// -----------------------------------------------
+
+simAsyncConsole::simAsyncConsole(zmq::context_t &ctx, std::string server)
+    : Sock(new zmq::socket_t(ctx, ZMQ_DEALER)), Server(server) {
+  int timeout = 1000;
+  Sock->setsockopt(ZMQ_SNDTIMEO, timeout);
+  Sock->setsockopt(ZMQ_LINGER, timeout);
+}
+
+bool simAsyncConsole::connect() {
+  if (!isValid() || Sock->connect(Server) != 0) {
+    std::ostringstream os;
+    os << "Cannot create client socket: " << zmq_strerror(zmq_errno());
+    lastErr = os.str();
+    return false;
+  }
+  lastErr.clear();
+  return true;
+}
+
+void simAsyncConsole::close() {
+  if (!Sock) return;
+  Sock->close();
+  Sock.reset();
+}
+
+bool simAsyncConsole::setHeartbeat(int ivl_ms, int timeout_ms) {
+#ifdef ZMQ_HEARTBEAT_IVL
+  int err = Sock->setsockopt(ZMQ_HEARTBEAT_IVL, &ivl_ms, sizeof(ivl_ms));
+  if (err >= 0)
+    err = Sock->setsockopt(ZMQ_HEARTBEAT_TIMEOUT, &timeout_ms,
+                           sizeof(timeout_ms));
+  if (err >= 0)
+    err = Sock->setsockopt(ZMQ_HEARTBEAT_TTL, &timeout_ms, sizeof(timeout_ms));
+  if (err >= 0) return true;
+  std::ostringstream os;
+  os << "Cannot set heartbeat: " << zmq_strerror(-err);
+  lastErr = os.str();
+#else
+  lastErr = "Heartbeats need libzmq 4.2 or later";
+#endif
+  return false;
+}
+
+uint64_t simAsyncConsole::submit(std::vector<std::string> frames, handler h) {
+  request r{0, std::string(), std::move(frames), std::move(h), {}};
+  return enqueue(std::move(r));
+}
+
+uint64_t simAsyncConsole::postActorMessage(const std::string &endpoint,
+                                           std::string        command,
+                                           handler            h) {
+  std::ostringstream os;
+  os << "{\n"
+     << "\"Type\" :  \"ActorMsg\",\n"
+     << "\"Endpoint\" : \"" << endpoint << "\"\n"
+     << "}";
+  request r{0, endpoint, {os.str(), std::move(command)}, std::move(h), {}};
+  return enqueue(std::move(r));
+}
+
+uint64_t simAsyncConsole::postActorMessage(commandEncoder &enc, handler h) {
+  request r{0, std::string(), {}, std::move(h), {}};
+  r.encoder = &enc;
+  return enqueue(std::move(r));
+}
+
+uint64_t simAsyncConsole::postActorMessages(commandEncoder *const *enc,
+                                            size_t n, handler h) {
+  request r{0, std::string(), {simConsole::BatchRequest}, std::move(h), {}};
+  r.encoders.assign(enc, enc + n);
+  return enqueue(std::move(r));
+}
+
+uint64_t simAsyncConsole::listEndpoints(
+    const std::string                                          &tag,
+    std::function<void(bool ok, std::vector<std::string> &res)> h) {
+  return submit({simConsole::request("ListEndpoint", "Tag", tag)},
+                [h](uint64_t, bool ok, const std::string &reply) {
+                  std::vector<std::string> res;
+                  ok = ok && simConsole::parseList(reply, res);
+                  h(ok, res);
+                });
+}
+
+uint64_t simAsyncConsole::getActorMetadata(
+    const std::string &actor, std::function<void(bool ok, Json &res)> h) {
+  return submit({simConsole::request("GetActorMeta", "Endpoint", actor)},
+                [h](uint64_t, bool ok, const std::string &reply) {
+                  Json res;
+                  ok = ok && simConsole::parseResult(reply, res);
+                  h(ok, res);
+                });
+}
+
+uint64_t simAsyncConsole::setEncoding(const std::string        &name,
+                                      std::function<void(bool ok)> h) {
+  return submit({simConsole::request("SetEncoding", "Encoding", name)},
+                [h, name](uint64_t, bool ok, const std::string &reply) {
+                  Json res;
+                  ok = ok && simConsole::parseResult(reply, res) &&
+                       res.is_string() &&
+                       res.get_ref<const std::string &>() == name;
+                  h(ok);
+                });
+}
+
+uint64_t simAsyncConsole::enqueue(request r) {
+  uint64_t         id  = r.id = NextId++;
+  std::string_view key = keyOf(r);
+  if (key.size()) {
+    for (auto &q : Queue) {
+      if (keyOf(q) != key) continue;
+      // called once the queue is consistent: the handler may submit again
+      uint64_t old        = q.id;
+      handler  superseded = std::move(q.done);
+      q                   = std::move(r);
+      ++Stats.coalesced;
+      if (superseded) superseded(old, false, std::string());
+      dispatch();
+      return id;
+    }
+  }
+  Queue.push_back(std::move(r));
+  dispatch();
+  return id;
+}
+
+int simAsyncConsole::sendOne(request &r) {
+  clock::time_point t0;
+  if (Latency) t0 = clock::now();
+  uint32_t id  = static_cast<uint32_t>(r.id);
+  int      err = Sock->send(&id, sizeof(id), ZMQ_SNDMORE | ZMQ_DONTWAIT);
+  // EAGAIN: not connected yet
+  if (err == -EAGAIN) return 0;
+  bool partial = err >= 0;
+  if (partial) err = Sock->send("", 0, ZMQ_SNDMORE);
+  // frames, then the encoders' [envelope][command] pairs
+  size_t last = r.frames.size() + r.encoders.size() + (r.encoder ? 1 : 0);
+  size_t i    = 0;
+  for (const auto &f : r.frames) {
+    if (err < 0) break;
+    err = Sock->send(f.data(), f.size(), ++i < last ? ZMQ_SNDMORE : 0);
+  }
+  for (auto enc : r.encoders) {
+    if (err < 0) break;
+    err = enc->send(*Sock, ++i < last ? ZMQ_SNDMORE : 0);
+  }
+  if (err >= 0 && r.encoder) err = r.encoder->send(*Sock, 0);
+  if (err < 0) {
+    std::ostringstream os;
+    os << "Could not send command to [" << Server
+       << "] :" << zmq_strerror(-err);
+    lastErr = os.str();
+    return partial ? -1 : 0;
+  }
+  r.sentAt = clock::now();
+  if (Latency) Latency->record(latencyStats::SEND, t0, r.sentAt);
+  ++Stats.sent;
+  return 1;
+}
+
+int simAsyncConsole::recvOne(uint64_t &id, std::string &reply) {
+  zmq::message_t msg;
+  int            err = Sock->recv(&msg, ZMQ_DONTWAIT);
+  if (err == -EAGAIN) return 0;
+  if (err < 0) {
+    std::ostringstream os;
+    os << "Could not receive response from [" << Server
+       << "] :" << zmq_strerror(-err);
+    lastErr = os.str();
+    return -1;
+  }
+  // [request id][empty][reply]
+  uint32_t rid = 0;
+  if (msg.size() == sizeof(rid)) memcpy(&rid, msg.data(), sizeof(rid));
+  reply.clear();
+  while (msg.more() && Sock->recv(&msg) >= 0) {
+    if (msg.size()) reply.assign(msg.data<char>(), msg.size());
+  }
+  id = rid;
+  return 1;
+}
+
+void simAsyncConsole::failAll() {
+  close();
+  // called once both are empty: handlers may submit again
+  std::vector<request> failed = std::move(InFlight);
+  for (auto &r : Queue) failed.push_back(std::move(r));
+  InFlight.clear();
+  Queue.clear();
+  for (auto &r : failed)
+    if (r.done) r.done(r.id, false, std::string());
+}
+
+void simAsyncConsole::expire() {
+  auto now = clock::now();
+  auto ttl = std::chrono::milliseconds(ReplyTimeout);
+  while (!InFlight.empty() && now - InFlight.front().sentAt > ttl) {
+    request r = std::move(InFlight.front());
+    InFlight.erase(InFlight.begin());
+    ++Stats.timedout;
+    if (r.done) r.done(r.id, false, std::string());
+  }
+}
+
+int simAsyncConsole::dispatch(int timeout_ms) {
+  if (!isValid()) return -1;
+  lastErr.clear();
+  auto        deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+  int         handled  = 0;
+  uint64_t    id;
+  std::string reply;
+  for (;;) {
+    while (!Queue.empty() && InFlight.size() < Window) {
+      int rc = sendOne(Queue.front());
+      if (rc < 0) {
+        failAll();
+        return -1;
+      }
+      if (rc == 0) break;
+      InFlight.push_back(std::move(Queue.front()));
+      Queue.erase(Queue.begin());
+    }
+    int rc = recvOne(id, reply);
+    if (rc < 0) return -1;
+    if (rc == 0) {
+      // wait only while nothing has been handled yet, and not past the
+      // expiry of the oldest request
+      auto until = deadline;
+      if (!InFlight.empty())
+        until = std::min(until, InFlight.front().sentAt +
+                                    std::chrono::milliseconds(ReplyTimeout));
+      long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      until - clock::now())
+                      .count();
+      if (handled || left <= 0 || InFlight.empty()) break;
+      zmq_pollitem_t item{static_cast<void *>(*Sock), 0, ZMQ_POLLIN, 0};
+      if (zmq::poll(&item, 1, left) <= 0) break;
+      continue;
+    }
+    // ids are sent as 32bit; compare the lower bits
+    for (auto it = InFlight.begin(); it != InFlight.end(); ++it) {
+      if (static_cast<uint32_t>(it->id) != id) continue;
+      request r = std::move(*it);
+      InFlight.erase(it);
+      ++Stats.acked;
+      ++handled;
+      if (Latency) Latency->record(latencyStats::REPLY, r.sentAt, clock::now());
+      if (r.done) r.done(r.id, true, reply);
+      break;
+    }
+  }
+  expire();
+  return handled;
+}
+
+bool simAsyncConsole::wait(int timeout_ms) {
+  auto deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (Queue.size() || InFlight.size()) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - clock::now())
+                    .count();
+    if (left <= 0) return false;
+    if (dispatch(static_cast<int>(left)) < 0) return false;
+  }
+  return true;
+}
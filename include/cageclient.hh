@@ -6,27 +6,42 @@ http://opensource.org/licenses/mit-license.php
 
 #pragma once
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 
+#include "asyncconsole.hh"
+#include "commandencoder.hh"
 #include "console.hh"
+#include "mailbox.hh"
+#include "metacache.hh"
+#include "reportdecoder.hh"
+#include "statusring.hh"
 #include "subscriber.hh"
 
 class CageAPI {
+  // before ZCtx: libzmq may read its buffers until the context is gone
+  commandEncoder                  Encoder;
   std::unique_ptr<zmq::context_t> ZCtx;
   std::string                     Endpoint;
   std::string                     VehicleName;
   std::string                     ReporterAddr, ConsoleAddr;
   std::string                     ErrorString;
-  // std::thread Thread;
-  // std::mutex Mutex;
-  // bool isTerminated=false;
+  std::thread                     Thread;
+  std::atomic<bool>               isTerminated{false};
 
   float RpmLeft = 0, RpmRight = 0;
+  bool  TopicSubscription = false;
+  bool  Conflate          = false;
 
-  std::unique_ptr<simSubscriber> Subscriber;
-  std::unique_ptr<simConsole>    Console;
+  std::unique_ptr<simSubscriber>   Subscriber;
+  std::unique_ptr<simConsole>      Console;
+  std::unique_ptr<simAsyncConsole> AsyncConsole;
+  bool                             AsyncCommands = false;
 
 public:
   struct vehicleStatus {
@@ -80,12 +95,69 @@ public:
   ~CageAPI();
   bool        connect();
   std::string getErrorString() { return ErrorString; }
+  // subscribe by topic prefix (see simSubscriber::setTopicMode).
+  // takes effect on the next connect()
+  void        setTopicSubscription(bool on) { TopicSubscription = on; }
+  // keep only the newest message in the subscriber queue (ZMQ_CONFLATE).
+  // for single vehicle worlds; takes effect on the next connect()
+  void        setConflate(bool on) { Conflate = on; }
 
   bool           isValid() { return ZCtx && Console && Subscriber; }
   simConsole &   getConsole() { return *Console; }
   simSubscriber &getSubscriber() { return *Subscriber; };
+  // wait for a report. timeout_us < 0 waits forever
   bool           poll(int timeout_us = -1);
   bool           getStatusOne(CageAPI::vehicleStatus &vst, int timeout_us = -1);
+  // deadline based variants for control loops waiting for their next tick
+  bool pollUntil(std::chrono::steady_clock::time_point deadline);
+  bool getStatusUntil(CageAPI::vehicleStatus              &vst,
+                      std::chrono::steady_clock::time_point deadline);
+  // like getStatusOne but drains all queued reports and decodes only the
+  // newest one. skipped receives the number of reports thrown away.
+  bool getStatusLatest(CageAPI::vehicleStatus &vst, int &skipped,
+                       int timeout_us = -1);
+
+  // Event loop integration. Watch getFd() (the subscriber's ZMQ_FD, edge
+  // triggered) for reading; when it fires call tryGetStatus() until it
+  // returns false. With async commands also watch
+  // getAsyncConsole()->getFd() and call poll(0) when it fires.
+  zmq::fd_t getFd() const { return Subscriber->getFd(); }
+  uint32_t  getEvents() const { return Subscriber->getEvents(); }
+  // decode the next queued report of the target vehicle without blocking.
+  // false with an empty error string when none is queued.
+  bool      tryGetStatus(CageAPI::vehicleStatus &vst);
+
+  // Background receiver: decodes reports on its own thread and keeps the
+  // newest status in a lock-free mailbox. While it runs, poll(),
+  // getStatusOne() and getSubscriber() must not be used.
+  bool startReceiver();
+  void stopReceiver();
+  // newest status from the receiver without blocking. returns its sequence
+  // number (increments per report), or 0 if none has arrived yet.
+  uint64_t getLatestStatus(vehicleStatus &vst) { return Latest.latest(vst); }
+  // keep the last reports of the receiver in a statusRing of this capacity
+  // (0: none). call while the receiver is stopped
+  void     setHistory(size_t capacity) {
+    History.reset(capacity ? new statusRing(capacity) : nullptr);
+  }
+  const statusRing *getHistory() const { return History.get(); }
+
+  // Latency instrumentation of reports (receive, filter, parse, decode,
+  // Time vs wall clock skew) and console requests (send, reply); see
+  // latencyStats. Off by default: then nothing is timed. Call while the
+  // receiver is stopped. The statistics are kept over reconnects.
+  void          setLatencyStats(bool on);
+  latencyStats *getLatencyStats() { return Latency.get(); }
+
+  // convert raw report fields into vehicleStatus (right-handed, SI units)
+  static void decodeStatus(const reportFields &f, vehicleStatus &vst);
+  // fill vehicleInfo from GetActorMeta of a vehicle (SI units, right-handed).
+  // both parsers throw Json::exception on malformed entries
+  static void parseVehicleInfo(const std::string &name, const Json &meta,
+                               vehicleInfo &info);
+  // fill worldInfo from GetActorMeta of a GeoReference actor. returns
+  // info.valid
+  static bool parseWorldInfo(const Json &grMeta, worldInfo &info);
 
   bool setRpm(double rpmL,
               double rpmR);        // Left wheel and Right wheel speed in [rpm]
@@ -93,6 +165,67 @@ public:
   bool setFLW(double F, double L,
               double W);  // Forward, Left, Angvel in  [m/s], [m/s], [rad/s]
 
+  // Send setRpm/setVW/setFLW through a pipelined DEALER channel instead of
+  // a REQ round trip. Replies are handled in poll(); a command not yet sent
+  // is replaced by a newer one. Call flushCommands() to wait for delivery.
+  bool             setAsyncCommands(bool on);
+  bool             flushCommands(int timeout_ms = 1000);
+  simAsyncConsole *getAsyncConsole() { return AsyncConsole.get(); }
+
+  // Wire format of reports and commands. WIRE_BINARY asks the console for
+  // the binary format of wireformat.hh during the connect() handshake (in
+  // the background after a metadata cache hit, and again after a
+  // supervised recovery). Reports are decoded in whichever format they
+  // arrive, so a console that refuses simply keeps JSON. The console
+  // switches for all its clients (see wireformat.hh). Takes effect on the
+  // next connect()
+  enum wireFormat { WIRE_JSON, WIRE_BINARY };
+  void       setWireFormat(wireFormat f) { Wire = f; }
+  // format the console accepted; commands are sent in it
+  wireFormat getWireFormat() const {
+    return BinaryAccepted ? WIRE_BINARY : WIRE_JSON;
+  }
+
+  // Metadata cache file. connect() then takes VehicleInfo and WorldInfo from
+  // the entry of (server, mapName, vehicle) if there is one and returns
+  // without waiting for the console; a background thread asks the console
+  // and updates the entry. The map is not reported by the simulator; give
+  // it to keep the entries of different maps apart. Call before connect();
+  // an empty path disables the cache.
+  void setMetadataCache(std::string path, std::string mapName = "");
+  enum metadataState {
+    META_FETCHED,    // fetched by connect()
+    META_CACHED,     // from the cache, being revalidated
+    META_VALID,      // from the cache, confirmed by the console
+    META_CHANGED,    // the console disagrees: see refreshMetadata()
+    META_UNCHECKED,  // from the cache, no valid answer from the console
+  };
+  metadataState getMetadataState() const { return MetaState; }
+  // take over the revalidated metadata after META_CHANGED. The subscriber
+  // follows a renamed target vehicle, except while the receiver runs
+  // (false then).
+  bool          refreshMetadata();
+
+  // Supervised session: heartbeats on all sockets and a background thread
+  // watching their connection events. While the simulator is away commands
+  // fail at once instead of blocking; when it is back the vehicle is looked
+  // up again (see getMetadataState()) and the sockets resume by themselves.
+  // heartbeat_ms 0 relies on TCP events only. takes effect on the next
+  // connect()
+  void setSupervision(bool on, int heartbeat_ms = 1000) {
+    Supervised  = on;
+    HeartbeatMs = heartbeat_ms;
+  }
+  enum sessionState { SESSION_UP, SESSION_DOWN, SESSION_RECOVERING };
+  sessionState getSessionState() const { return Session; }
+  // number of completed recoveries
+  uint64_t     getRecoveries() const { return Recoveries; }
+
+  // ActorMsg payloads for the commands above
+  static std::string rpmCommand(double rpmL, double rpmR);
+  static std::string vwCommand(double V, double W);
+  static std::string flwCommand(double F, double L, double W);
+
   std::string getError() { return ErrorString; }
 
   void setDefaultTransform(std::string           frameId,
@@ -100,6 +233,96 @@ public:
                            std::array<double, 4> rotation);
 
 private:
+  // [ms] stop request latency of the receiver and the revalidation, time
+  // limit of connect()
+  static constexpr int         ReceiverPollMs     = 100;
+  static constexpr int         StopPollMs         = 100;
+  static constexpr int         HandshakeTimeoutMs = 2000;
+  latestMailbox<vehicleStatus> Latest;
+  std::unique_ptr<statusRing>  History;
+  std::unique_ptr<latencyStats> Latency;
+  bool                          Timed = false;
+  wireFormat                    Wire  = WIRE_JSON;
+  std::atomic<bool>             BinaryAccepted{false};  // set by handshakes
+  // hand Latency (or nullptr) to the sockets
+  void attachLatency();
+
+  enum readResult { READ_OK, READ_RECV_ERROR, READ_UNEXPECTED, READ_NONE };
+  // receive and decode one (or the newest queued) report without touching
+  // ErrorString. READ_NONE: nothing queued with ZMQ_DONTWAIT in flags
+  readResult readStatus(vehicleStatus &vst, bool latest,
+                        int *skipped = nullptr, int flags = 0);
+  // poll() with async commands: wait on reports and command replies at
+  // once, handling the replies as they come
+  bool waitReport(std::chrono::steady_clock::time_point deadline,
+                  bool forever);
+  // set ErrorString for a failed readStatus
+  bool       checkRead(readResult r);
+
+  struct metadata {
+    std::string endpoint;
+    vehicleInfo info;
+    worldInfo   world{};
+  };
+  enum fetchResult {
+    FETCH_OK,
+    FETCH_NO_LIST,
+    FETCH_NO_VEHICLE,
+    FETCH_NO_META,
+    FETCH_BAD_META  // the vehicle metadata could not be parsed
+  };
+  // the connect() handshake over hs. md.info is updated, not replaced.
+  // verbose lists the endpoints and transforms on std::cerr. never throws,
+  // so that it can run on the background threads
+  fetchResult fetchMetadata(simAsyncConsole &hs, metadata &md, bool verbose,
+                            const std::atomic<bool> *stop = nullptr);
+
+  std::unique_ptr<metadataCache> Cache;
+  std::string                    MapName;
+  std::thread                    Revalidator;
+  std::atomic<bool>              StopRevalidation{false};
+  std::atomic<metadataState>     MetaState{META_FETCHED};
+  std::mutex                     MetaLock;
+  metadata                       Fresh;  // revalidated, guarded by MetaLock
+
+  std::string        cacheKey() const;
+  static std::string encodeMetadata(const metadata &md);
+  static bool        decodeMetadata(const std::string &blob, metadata &md);
+  void revalidate(metadata base, std::string cached, std::string path,
+                  std::string key);
+  // hand md to refreshMetadata() and update the cache file at path
+  void publishFresh(const metadata &md, const std::string &fresh,
+                    const std::string &path, const std::string &key);
+  void stopRevalidation();
+
+  class sessionMonitor : public zmq::monitor_t {
+  public:
+    bool up = false;  // the socket has a connection
+    void on_event_connected(const zmq_event_t &, const char *) override {
+      up = true;
+    }
+    void on_event_disconnected(const zmq_event_t &, const char *) override {
+      up = false;
+    }
+  };
+  bool                            Supervised  = false;
+  int                             HeartbeatMs = 1000;
+  std::unique_ptr<sessionMonitor> ConsoleMonitor, SubscriberMonitor;
+  std::thread                     Supervisor;
+  std::atomic<bool>               StopSupervisor{false};
+  std::atomic<sessionState>       Session{SESSION_UP};
+  std::atomic<uint64_t>           Recoveries{0};
+
+  // heartbeat and monitor a socket before it connects
+  template <typename S>
+  void supervise(S &sock, std::unique_ptr<sessionMonitor> &mon,
+                 const char *name);
+  void startSupervisor(metadata base, std::string current, bool up);
+  void runSupervisor(metadata base, std::string current);
+  void stopSupervisor();
+  // monitors first: they detach from the sockets when destroyed
+  void teardown();
+
   template <typename F>
   void setErrorStrm(F f) {
     std::ostringstream ost;
@@ -110,7 +333,10 @@ private:
 
   void clearError() { ErrorString.clear(); }
 
-  double decode60(std::array<double, 3> v) {
+  // send the command last encoded by Encoder to Endpoint
+  bool sendCommand();
+
+  static double decode60(std::array<double, 3> v) {
     double d = v[0], m = v[1], s = v[2];
     return ((s / 60.) + m) / 60. + d;
   }
@@ -136,7 +362,12 @@ CageAPI::CageAPI(std::string peerAddr, std::string targetVehicle) {
   VehicleName  = targetVehicle;
 }
 
-CageAPI::~CageAPI()=default;
+CageAPI::~CageAPI() {
+  stopSupervisor();
+  stopRevalidation();
+  stopReceiver();
+  flushCommands();
+}
 
 void CageAPI::setDefaultTransform(std::string           frameId,
                                   std::array<double, 3> translation,
@@ -146,9 +377,13 @@ void CageAPI::setDefaultTransform(std::string           frameId,
 
 bool CageAPI::connect() {
   std::ostringstream ost;
+  stopReceiver();
+  stopRevalidation();
+  stopSupervisor();
+  BinaryAccepted = false;
   // ZMQ Context
-  Subscriber.reset();
-  Console.reset();
+  AsyncConsole.reset();
+  teardown();
   ZCtx.reset(new zmq::context_t(1));
   if (!ZCtx || !ZCtx->isValid()) {
     setErrorStrm([](auto &s) {
@@ -158,222 +393,716 @@ bool CageAPI::connect() {
   }
   // Command Socket
   Console.reset(new simConsole(*ZCtx, ConsoleAddr));
+  if (Supervised) supervise(*Console, ConsoleMonitor, "console");
   if (!Console || !Console->connect()) {
     setError(Console->getLastError());
-    Console.reset();
-    ZCtx.reset();
+    teardown();
     return false;
   }
 
-  // List endpoint
-  std::vector<std::string> targets;
-  if (!Console->listEndpoints("Vehicle", targets)) {
-    setErrorStrm([&](auto &s) {
-      s << "Unable to get endpoint list: " << Console->getLastError();
-    });
-    Console.reset();
-    ZCtx.reset();
+  // Reporter Socket. connected first so that reports are buffered while the
+  // metadata is fetched; the target actor is added once it is known
+  Subscriber.reset(new simSubscriber(*ZCtx, ReporterAddr));
+  if (Subscriber) {
+    Subscriber->setTopicMode(TopicSubscription);
+    if (Conflate && !Subscriber->setConflate(true))
+      std::cerr << Subscriber->getLastError() << std::endl;
+    if (Supervised) supervise(*Subscriber, SubscriberMonitor, "reporter");
+  }
+  attachLatency();
+  if (!Subscriber || !Subscriber->connect()) {
+    setError(Subscriber->getLastError());
+    teardown();
     return false;
   }
 
-  std::string endpoint;
-  for (const auto &e : targets) {
-    std::cerr << "Vehicle :" << e;
-    if (endpoint.size() == 0) {
-      if (VehicleName.size() == 0 || e.find(VehicleName) != std::string::npos) {
-        endpoint = e;
-        std::cerr << " <- target selected";
-      }
+  // Start from the cache when it knows this target. The console is asked
+  // in the background.
+  // base keeps transforms set by setDefaultTransform
+  metadata    base = {std::string(), VehicleInfo, worldInfo{}};
+  metadata    md   = base;
+  std::string cached;
+  if (Cache && Cache->load() && Cache->find(cacheKey(), cached) &&
+      decodeMetadata(cached, md)) {
+    Subscriber->addTargetActor(md.endpoint);
+    Endpoint    = md.endpoint;
+    VehicleInfo = md.info;
+    WorldInfo   = md.world;
+    MetaState   = META_CACHED;
+    if (Supervised) {
+      // revalidated by the supervisor once the sockets are connected
+      startSupervisor(base, cached, false);
+    } else {
+      StopRevalidation = false;
+      Revalidator      = std::thread(
+          [this, base, cached, path = Cache->getPath(), key = cacheKey()] {
+            revalidate(base, cached, path, key);
+          });
     }
-    std::cerr << std::endl;
+    if (AsyncCommands && !setAsyncCommands(true)) return false;
+    ErrorString = "";
+    return true;
   }
-  if (endpoint.size() == 0) {
+
+  std::unique_ptr<simAsyncConsole> hs(new simAsyncConsole(*ZCtx, ConsoleAddr));
+  if (Supervised && HeartbeatMs) hs->setHeartbeat(HeartbeatMs, 3 * HeartbeatMs);
+  hs->setLatencyStats(Timed ? Latency.get() : nullptr);
+  if (!hs->connect()) {
+    setError(hs->getLastError());
+    hs.reset();
+    teardown();
+    return false;
+  }
+  fetchResult r = fetchMetadata(*hs, md, true);
+  // handlers of unanswered requests refer to fetchMetadata's frame: reuse
+  // the socket only after a complete handshake. it must be gone before
+  // ZCtx is reset
+  if (AsyncCommands && !hs->inFlight() && !hs->queued())
+    AsyncConsole = std::move(hs);
+  else
+    hs.reset();
+
+  if (r == FETCH_NO_LIST) {
+    setErrorStrm([&](auto &s) {
+      s << "Unable to get endpoint list: no valid response from ["
+        << ConsoleAddr << "]";
+    });
+    teardown();
+    return false;
+  }
+  if (r == FETCH_NO_VEHICLE) {
     setError("No matching vehicle found.");
-    Console.reset();
-    ZCtx.reset();
+    teardown();
     return false;
   }
 
-  // GeoReference
-  targets.clear();
-  std::string geoReference;
-  if (Console->listEndpoints("GeoReference", targets)) {
-    if (targets.size() > 1) {
-      std::cerr << "Multiple GeoReference reported. Using the first one ["
-                << targets[0] << "]." << std::endl;
-    }
-    geoReference = targets[0];
-    Json grMeta;
-    if (!Console->getActorMetadata(geoReference, grMeta)) {
-      setError("Failed to fetch geo-reference metadata");
-    } else {
-      std::cerr << "GeoReference Actor [" << geoReference << "]" << std::endl;
-      WorldInfo.valid = false;
-      if (grMeta.count("GeoLocation")) {
-        auto loc             = grMeta["GeoLocation"];
-        auto lat             = loc["latitude"];
-        auto lon             = loc["longitude"];
-        WorldInfo.Latitude0  = decode60({static_cast<double>(lat["x"]),
-                                        static_cast<double>(lat["y"]),
-                                        static_cast<double>(lat["z"])});
-        WorldInfo.Longitude0 = decode60({static_cast<double>(lon["x"]),
-                                         static_cast<double>(lon["y"]),
-                                         static_cast<double>(lon["z"])});
-        if (grMeta.count("Transform")) {
-          auto trans                     = grMeta["Transform"];
-          auto t                         = trans["translation"];
-          WorldInfo.ReferenceLocation[0] = static_cast<double>(t["x"]);
-          WorldInfo.ReferenceLocation[1] = static_cast<double>(t["y"]);
-          WorldInfo.ReferenceLocation[2] = static_cast<double>(t["z"]);
-          auto r                         = trans["rotation"];
-          WorldInfo.ReferenceRotation[0] = static_cast<double>(r["w"]);
-          WorldInfo.ReferenceRotation[1] = static_cast<double>(r["x"]);
-          WorldInfo.ReferenceRotation[2] = static_cast<double>(r["y"]);
-          WorldInfo.ReferenceRotation[3] = static_cast<double>(r["z"]);
-          WorldInfo.valid                = true;
+  Subscriber->addTargetActor(md.endpoint);
+  Endpoint  = md.endpoint;
+  WorldInfo = md.world;
+  if (r == FETCH_NO_META) {
+    setError("Failed to fetch vehicle metadata");
+    return false;
+  }
+  if (r == FETCH_BAD_META) {
+    setError("Malformed vehicle metadata");
+    return false;
+  }
+  VehicleInfo = md.info;
+  MetaState   = META_FETCHED;
+  if (Cache) {
+    if (!Cache->update(cacheKey(), encodeMetadata(md)))
+      std::cerr << Cache->getLastError() << std::endl;
+  }
+  if (Supervised) startSupervisor(base, encodeMetadata(md), true);
+  if (AsyncCommands && !setAsyncCommands(true)) return false;
+  ErrorString = "";
+  return true;
+}
+
+// Handshake over a DEALER socket: both endpoint lists are requested at once
+// and each metadata request goes out as soon as its actor is known. The
+// metadata of VehicleName is requested up front, which saves a round trip
+// when it names the vehicle exactly.
+CageAPI::fetchResult CageAPI::fetchMetadata(simAsyncConsole         &hs,
+                                            metadata                &md,
+                                            bool                     verbose,
+                                            const std::atomic<bool> *stop) {
+  bool listed = false, guessed = false, metaOk = false;
+  Json meta, guessMeta;
+  auto onMeta = [&](bool ok, Json &res) {
+    metaOk = ok;
+    meta   = std::move(res);
+  };
+  md.endpoint.clear();
+  if (Wire == WIRE_BINARY)
+    hs.setEncoding(cagewire::Name, [this](bool ok) { BinaryAccepted = ok; });
+  if (VehicleName.size())
+    hs.getActorMetadata(VehicleName, [&](bool ok, Json &res) {
+      guessed   = ok;
+      guessMeta = std::move(res);
+    });
+  hs.listEndpoints("Vehicle", [&](bool ok, std::vector<std::string> &res) {
+    listed = ok;
+    for (const auto &e : res) {
+      if (verbose) std::cerr << "Vehicle :" << e;
+      if (md.endpoint.size() == 0) {
+        if (VehicleName.size() == 0 ||
+            e.find(VehicleName) != std::string::npos) {
+          md.endpoint = e;
+          if (verbose) std::cerr << " <- target selected";
         }
       }
+      if (verbose) std::cerr << std::endl;
+    }
+    // VehicleName itself was requested up front
+    if (md.endpoint.size() && md.endpoint != VehicleName)
+      hs.getActorMetadata(md.endpoint, onMeta);
+  });
+  hs.listEndpoints("GeoReference", [&](bool ok,
+                                       std::vector<std::string> &res) {
+    if (!ok || res.empty()) return;
+    if (verbose && res.size() > 1) {
+      std::cerr << "Multiple GeoReference reported. Using the first one ["
+                << res[0] << "]." << std::endl;
     }
+    std::string geoReference = res[0];
+    hs.getActorMetadata(geoReference, [&, geoReference](bool ok,
+                                                        Json &grMeta) {
+      if (!ok) {
+        if (verbose)
+          std::cerr << "Failed to fetch geo-reference metadata" << std::endl;
+        return;
+      }
+      if (verbose)
+        std::cerr << "GeoReference Actor [" << geoReference << "]"
+                  << std::endl;
+      worldInfo world{};
+      try {
+        parseWorldInfo(grMeta, world);
+      } catch (const Json::exception &e) {
+        // md.world stays invalid
+        if (verbose)
+          std::cerr << "Malformed geo-reference metadata: " << e.what()
+                    << std::endl;
+        return;
+      }
+      md.world = world;
+    });
+  });
+  md.world.valid = false;
+
+  // in slices, so that a background caller can give up early
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(HandshakeTimeoutMs);
+  while (!hs.wait(StopPollMs)) {
+    if ((stop && *stop) || std::chrono::steady_clock::now() >= deadline)
+      break;
   }
 
-  // Reporter Socket
-  Subscriber.reset(new simSubscriber(*ZCtx, ReporterAddr));
-  if (!Subscriber || !Subscriber->connect()) {
-    setError(Subscriber->getLastError());
-    Subscriber.reset();
-    Console.reset();
-    ZCtx.reset();
-    return false;
+  if (!listed) return FETCH_NO_LIST;
+  if (md.endpoint.size() == 0) return FETCH_NO_VEHICLE;
+  if (md.endpoint == VehicleName) {
+    metaOk = guessed;
+    meta   = std::move(guessMeta);
+  }
+  if (!metaOk) return FETCH_NO_META;
+  vehicleInfo info = md.info;
+  try {
+    parseVehicleInfo(md.endpoint, meta, info);
+  } catch (const Json::exception &e) {
+    if (verbose)
+      std::cerr << "Malformed metadata of [" << md.endpoint
+                << "] : " << e.what() << std::endl;
+    return FETCH_BAD_META;
   }
+  if (verbose)
+    for (const auto &t : info.Transforms)
+      std::cerr << "Found Transform for : " << t.first << std::endl;
+  md.info = std::move(info);
+  return FETCH_OK;
+}
 
-  Subscriber->addTargetActor(endpoint);
-  Endpoint = endpoint;
-  Json meta;
-  if (!Console->getActorMetadata(endpoint, meta)) {
-    setError("Failed to fetch vehicle metadata");
-    return false;
+void CageAPI::setMetadataCache(std::string path, std::string mapName) {
+  if (path.empty())
+    Cache.reset();
+  else
+    Cache.reset(new metadataCache(path));
+  MapName = mapName;
+}
+
+std::string CageAPI::cacheKey() const {
+  return ConsoleAddr + '\n' + MapName + '\n' + VehicleName;
+}
+
+std::string CageAPI::encodeMetadata(const metadata &md) {
+  std::string      blob;
+  cagemeta::writer w(blob);
+  w.str(md.endpoint);
+  w.str(md.info.name);
+  w.put(md.info.WheelPerimeterL);
+  w.put(md.info.WheelPerimeterR);
+  w.put(md.info.TreadWidth);
+  w.put(md.info.ReductionRatio);
+  w.put(static_cast<uint32_t>(md.info.Transforms.size()));
+  for (const auto &t : md.info.Transforms) {
+    w.str(t.first);
+    w.put(t.second);
+  }
+  w.put(static_cast<uint8_t>(md.world.valid));
+  w.put(md.world.Latitude0);
+  w.put(md.world.Longitude0);
+  w.put(md.world.ReferenceLocation);
+  w.put(md.world.ReferenceRotation);
+  return blob;
+}
+
+bool CageAPI::decodeMetadata(const std::string &blob, metadata &md) {
+  cagemeta::reader r(blob.data(), blob.size());
+  uint32_t         transforms = 0;
+  r.str(md.endpoint);
+  r.str(md.info.name);
+  r.get(md.info.WheelPerimeterL);
+  r.get(md.info.WheelPerimeterR);
+  r.get(md.info.TreadWidth);
+  r.get(md.info.ReductionRatio);
+  r.get(transforms);
+  for (uint32_t i = 0; i < transforms && r.ok(); ++i) {
+    std::string frame;
+    Transform   t;
+    if (r.str(frame) && r.get(t)) md.info.Transforms[frame] = t;
+  }
+  uint8_t valid = 0;
+  r.get(valid);
+  r.get(md.world.Latitude0);
+  r.get(md.world.Longitude0);
+  r.get(md.world.ReferenceLocation);
+  r.get(md.world.ReferenceRotation);
+  md.world.valid = valid != 0;
+  return r.ok() && r.atEnd() && md.endpoint.size();
+}
+
+void CageAPI::revalidate(metadata base, std::string cached, std::string path,
+                         std::string key) {
+  simAsyncConsole hs(*ZCtx, ConsoleAddr);
+  metadata        md = base;
+  if (!hs.connect() || fetchMetadata(hs, md, false, &StopRevalidation) !=
+                           FETCH_OK) {
+    MetaState = META_UNCHECKED;
+    return;
+  }
+  std::string fresh = encodeMetadata(md);
+  if (fresh == cached) {
+    MetaState = META_VALID;
+    return;
+  }
+  publishFresh(md, fresh, path, key);
+}
+
+void CageAPI::publishFresh(const metadata &md, const std::string &fresh,
+                           const std::string &path, const std::string &key) {
+  {
+    std::lock_guard<std::mutex> lock(MetaLock);
+    Fresh = md;
+  }
+  if (path.size()) {
+    // Cache belongs to the caller's thread
+    metadataCache cache(path);
+    if (!cache.update(key, fresh))
+      std::cerr << cache.getLastError() << std::endl;
+  }
+  MetaState = META_CHANGED;
+}
+
+void CageAPI::stopRevalidation() {
+  if (!Revalidator.joinable()) return;
+  StopRevalidation = true;
+  Revalidator.join();
+}
+
+template <typename S>
+void CageAPI::supervise(S &sock, std::unique_ptr<sessionMonitor> &mon,
+                        const char *name) {
+  if (HeartbeatMs && !sock.setHeartbeat(HeartbeatMs, 3 * HeartbeatMs))
+    std::cerr << sock.getLastError() << std::endl;
+  std::ostringstream addr;
+  addr << "inproc://cageapi-" << static_cast<const void *>(this) << "-"
+       << name;
+  mon.reset(new sessionMonitor);
+  if (!sock.startMonitor(*mon, addr.str())) {
+    std::cerr << sock.getLastError() << std::endl;
+    mon.reset();
+  }
+}
+
+void CageAPI::startSupervisor(metadata base, std::string current, bool up) {
+  if (!ConsoleMonitor || !SubscriberMonitor) return;
+  Session        = up ? SESSION_UP : SESSION_DOWN;
+  StopSupervisor = false;
+  Supervisor     = std::thread([this, base, current, up] {
+    // connection events of the handshake are queued; mark them seen
+    ConsoleMonitor->up = SubscriberMonitor->up = up;
+    runSupervisor(base, current);
+  });
+}
+
+void CageAPI::runSupervisor(metadata base, std::string current) {
+  std::string path = Cache ? Cache->getPath() : std::string();
+  std::string key  = cacheKey();
+  while (!StopSupervisor) {
+    ConsoleMonitor->check_event(StopPollMs);
+    while (ConsoleMonitor->check_event(0)) {
+    }
+    while (SubscriberMonitor->check_event(0)) {
+    }
+    if (!ConsoleMonitor->up || !SubscriberMonitor->up) {
+      Session = SESSION_DOWN;
+      continue;
+    }
+    if (Session == SESSION_UP) continue;
+
+    // back (or connected for the first time): look the vehicle up again
+    Session = SESSION_RECOVERING;
+    simAsyncConsole hs(*ZCtx, ConsoleAddr);
+    metadata        md = base;
+    if (!hs.connect() ||
+        fetchMetadata(hs, md, false, &StopSupervisor) != FETCH_OK) {
+      if (MetaState == META_CACHED) MetaState = META_UNCHECKED;
+      continue;  // retried while the sockets stay connected
+    }
+    std::string fresh = encodeMetadata(md);
+    if (fresh != current) {
+      publishFresh(md, fresh, path, key);
+      current = fresh;
+    } else if (MetaState == META_CACHED || MetaState == META_UNCHECKED) {
+      MetaState = META_VALID;
+    }
+    ++Recoveries;
+    Session = SESSION_UP;
   }
-  VehicleInfo.name = endpoint;
+}
+
+void CageAPI::stopSupervisor() {
+  if (!Supervisor.joinable()) return;
+  StopSupervisor = true;
+  Supervisor.join();
+}
+
+void CageAPI::teardown() {
+  SubscriberMonitor.reset();
+  ConsoleMonitor.reset();
+  Subscriber.reset();
+  Console.reset();
+  ZCtx.reset();
+}
+
+bool CageAPI::refreshMetadata() {
+  if (MetaState != META_CHANGED) return true;
+  std::lock_guard<std::mutex> lock(MetaLock);
+  if (Fresh.endpoint != Endpoint) {
+    if (Thread.joinable()) {
+      setError("Target vehicle changed to " + Fresh.endpoint +
+               "; stop the receiver first.");
+      return false;
+    }
+    Subscriber->setTargetActor(Fresh.endpoint);
+    Endpoint = Fresh.endpoint;
+  }
+  VehicleInfo = Fresh.info;
+  WorldInfo   = Fresh.world;
+  MetaState   = META_VALID;
+  return true;
+}
+
+void CageAPI::parseVehicleInfo(const std::string &name, const Json &meta,
+                               vehicleInfo &info) {
+  info.name = name;
   if (meta.count("TreadWidth"))
-    VehicleInfo.TreadWidth = static_cast<double>(meta["TreadWidth"]) / 100.;
+    info.TreadWidth = static_cast<double>(meta["TreadWidth"]) / 100.;
   if (meta.count("WheelPerimeterL"))
-    VehicleInfo.WheelPerimeterL =
-        static_cast<double>(meta["WheelPerimeterL"]) / 100.;
+    info.WheelPerimeterL = static_cast<double>(meta["WheelPerimeterL"]) / 100.;
   if (meta.count("WheelPerimeterR"))
-    VehicleInfo.WheelPerimeterR =
-        static_cast<double>(meta["WheelPerimeterR"]) / 100.;
+    info.WheelPerimeterR = static_cast<double>(meta["WheelPerimeterR"]) / 100.;
   if (meta.count("ReductionRatio"))
-    VehicleInfo.ReductionRatio = static_cast<double>(meta["ReductionRatio"]);
+    info.ReductionRatio = static_cast<double>(meta["ReductionRatio"]);
   const std::string transform{"Transform-"};
   for (const auto &kv : meta.items()) {
     const auto &key=kv.key();
     const auto &value = kv.value();
     if (key.compare(0, transform.size(), transform) != 0) continue;
     std::string coord{key.substr(transform.size())};
-    std::cout << "Found Transform for : " << coord << std::endl;
-    Transform t;
-    t.trans[0] = static_cast<double>(value["translation"]["x"]) / 100.;
-    t.trans[1] = static_cast<double>(value["translation"]["y"]) / 100. * -1.;
-    t.trans[2] = static_cast<double>(value["translation"]["z"]) / 100.;
-    t.rot[0]   = static_cast<double>(value["rotation"]["w"]) * -1.;
-    t.rot[1]   = static_cast<double>(value["rotation"]["x"]);
-    t.rot[2]   = static_cast<double>(value["rotation"]["y"]) * -1.;
-    t.rot[3]   = static_cast<double>(value["rotation"]["z"]);
-    VehicleInfo.Transforms[coord] = t;
+    const auto &tr  = value.at("translation");
+    const auto &rot = value.at("rotation");
+    Transform   t;
+    t.trans[0] = static_cast<double>(tr.at("x")) / 100.;
+    t.trans[1] = static_cast<double>(tr.at("y")) / 100. * -1.;
+    t.trans[2] = static_cast<double>(tr.at("z")) / 100.;
+    t.rot[0]   = static_cast<double>(rot.at("w")) * -1.;
+    t.rot[1]   = static_cast<double>(rot.at("x"));
+    t.rot[2]   = static_cast<double>(rot.at("y")) * -1.;
+    t.rot[3]   = static_cast<double>(rot.at("z"));
+    info.Transforms[coord] = t;
   }
-  ErrorString = "";
-  return true;
 }
-bool CageAPI::poll(int timeout_us) { return Subscriber->waitFor(timeout_us); }
+
+bool CageAPI::parseWorldInfo(const Json &grMeta, worldInfo &info) {
+  info.valid = false;
+  if (!grMeta.count("GeoLocation")) return false;
+  const auto &loc = grMeta.at("GeoLocation");
+  const auto &lat = loc.at("latitude");
+  const auto &lon = loc.at("longitude");
+  info.Latitude0  = decode60({static_cast<double>(lat.at("x")),
+                             static_cast<double>(lat.at("y")),
+                             static_cast<double>(lat.at("z"))});
+  info.Longitude0 = decode60({static_cast<double>(lon.at("x")),
+                              static_cast<double>(lon.at("y")),
+                              static_cast<double>(lon.at("z"))});
+  if (grMeta.count("Transform")) {
+    const auto &trans         = grMeta.at("Transform");
+    const auto &t             = trans.at("translation");
+    info.ReferenceLocation[0] = static_cast<double>(t.at("x"));
+    info.ReferenceLocation[1] = static_cast<double>(t.at("y"));
+    info.ReferenceLocation[2] = static_cast<double>(t.at("z"));
+    const auto &r             = trans.at("rotation");
+    info.ReferenceRotation[0] = static_cast<double>(r.at("w"));
+    info.ReferenceRotation[1] = static_cast<double>(r.at("x"));
+    info.ReferenceRotation[2] = static_cast<double>(r.at("y"));
+    info.ReferenceRotation[3] = static_cast<double>(r.at("z"));
+    info.valid                = true;
+  }
+  return info.valid;
+}
+bool CageAPI::poll(int timeout_us) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::microseconds(timeout_us);
+  if (AsyncConsole) return waitReport(deadline, timeout_us < 0);
+  if (timeout_us < 0) return Subscriber->waitFor(-1);
+  return Subscriber->waitUntil(deadline);
+}
+
+bool CageAPI::pollUntil(std::chrono::steady_clock::time_point deadline) {
+  if (AsyncConsole) return waitReport(deadline, false);
+  return Subscriber->waitUntil(deadline);
+}
+
+bool CageAPI::waitReport(std::chrono::steady_clock::time_point deadline,
+                         bool forever) {
+  enum { REPORTS, REPLIES };
+  zmq::poller_t<2> poller;
+  poller.add(Subscriber->getSocket());
+  poller.add(AsyncConsole->getSocket());
+  for (;;) {
+    AsyncConsole->dispatch();
+    long left = -1;
+    if (!forever) {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    deadline - std::chrono::steady_clock::now())
+                    .count();
+      // zmq_poll waits whole milliseconds; the rest goes to the finer
+      // subscriber wait and replies are taken on the next call
+      if (ns < 1000000) return Subscriber->waitUntil(deadline);
+      left = static_cast<long>(ns / 1000000);
+    }
+    // unanswered commands expire in dispatch()
+    if (AsyncConsole->inFlight() && (left < 0 || left > StopPollMs))
+      left = StopPollMs;
+    bool report = false;
+    int  rc     = poller.wait(left, [&](size_t i, short) {
+      if (i == REPORTS) report = true;
+    });
+    if (rc < 0 && rc != -EINTR) return false;
+    if (report) return true;
+  }
+}
+
 bool CageAPI::getStatusOne(CageAPI::vehicleStatus &vst, int timeout_us) {
   if (!poll(timeout_us)) return false;
-  auto j = Subscriber->recvOne();
+  return checkRead(readStatus(vst, false));
+}
+
+bool CageAPI::getStatusUntil(CageAPI::vehicleStatus              &vst,
+                             std::chrono::steady_clock::time_point deadline) {
+  if (!pollUntil(deadline)) return false;
+  return checkRead(readStatus(vst, false));
+}
+
+bool CageAPI::getStatusLatest(CageAPI::vehicleStatus &vst, int &skipped,
+                              int timeout_us) {
+  skipped = 0;
+  if (!poll(timeout_us)) return false;
+  return checkRead(readStatus(vst, true, &skipped));
+}
+
+bool CageAPI::tryGetStatus(CageAPI::vehicleStatus &vst) {
+  if (AsyncConsole) AsyncConsole->dispatch();
+  for (;;) {
+    // other actors' reports are skipped: the fd would not fire again for
+    // the ones still queued
+    readResult r = readStatus(vst, false, nullptr, ZMQ_DONTWAIT);
+    if (r == READ_UNEXPECTED) continue;
+    clearError();
+    return checkRead(r);
+  }
+}
+
+bool CageAPI::checkRead(readResult r) {
+  switch (r) {
+    case READ_OK:
+      return true;
+    case READ_NONE:
+      return false;
+    case READ_RECV_ERROR:
+      setError(Subscriber->getLastError());
+      return false;
+    default:
+      setErrorStrm([](auto &ost) { ost << "Unexpected json structure."; });
+      return false;
+  }
+}
+
+CageAPI::readResult CageAPI::readStatus(vehicleStatus &vst, bool latest,
+                                        int *skipped, int flags) {
+  using lclock = latencyStats::clock;
+  latencyStats      *l = Timed ? Latency.get() : nullptr;
+  lclock::time_point t;
+  zmq::message_t     msg;
+  std::string_view   data;           // the payload in place, never copied
+  bool               target = true;  // recvLatest filters by itself
+  if (latest) {
+    if (!Subscriber->recvLatest(msg, *skipped))
+      return Subscriber->getLastError().empty() ? READ_UNEXPECTED
+                                                : READ_RECV_ERROR;
+    data = msg.view();
+    if (l) t = lclock::now();
+  } else {
+    if (!Subscriber->recvView(data, flags))
+      return Subscriber->getLastError().empty() ? READ_NONE : READ_RECV_ERROR;
+    target = Subscriber->filterReport(data.data(), data.size());
+    if (l) {
+      t = lclock::now();
+      l->record(latencyStats::FILTER, Subscriber->lastRecvTime(), t);
+    }
+  }
+  reportFields f;
+  Json         j;
+  if (!target) {
+    f.present = 0;
+  } else if (!reportDecoder::decode(data.data(), data.size(), f)) {
+    // unknown payload: take the generic json path (times PARSE itself)
+    j = Subscriber->parseReport(data.data(), data.size());
+    reportDecoder::fromJson(j, f);
+  } else {
+    if (l) l->record(latencyStats::PARSE, t, lclock::now());
+    if (!Subscriber->isTargetActor(f.name)) f.present = 0;
+  }
   // std::cout<<"Recv:["<<j<<"]"<<std::endl;
-  if (j.find("Data") == j.end()) {
-    setErrorStrm([](auto &ost) { ost << "Unexpected json structure."; });
-    return false;
+  if (!f.has(reportFields::DATA | reportFields::TIME)) return READ_UNEXPECTED;
+  if (l) t = lclock::now();
+  decodeStatus(f, vst);
+  if (l) {
+    auto done = lclock::now();
+    auto recv = Subscriber->lastRecvTime();
+    l->record(latencyStats::DECODE, t, done);
+    l->record(latencyStats::PIPELINE, recv, done);
+    l->recordSkew(vst.simClock, recv);
   }
-  if (j.find("Time") == j.end()) {
-    setErrorStrm([](auto &ost) { ost << "Unexpected json structure."; });
+  return READ_OK;
+}
+
+bool CageAPI::startReceiver() {
+  if (!isValid()) {
+    setError("Not connected.");
     return false;
   }
-  vst.simClock = static_cast<double>(j["Time"]);
-  auto r       = j["Data"];
-  if (r.find("LeftRpm") != r.end())
-    vst.lrpm = static_cast<double>(r["LeftRpm"]);
-  if (r.find("RightRpm") != r.end())
-    vst.rrpm = static_cast<double>(r["RightRpm"]);
-  auto accel = r.find("Accel");
-  if (accel != r.end()) {
-    Json a = *accel;
+  if (Thread.joinable()) return true;
+  isTerminated = false;
+  Thread       = std::thread([this]() {
+    // fields missing in a report keep their last value, as in getStatusOne
+    vehicleStatus vst{};
+    while (!isTerminated.load(std::memory_order_relaxed)) {
+      if (!Subscriber->waitFor(ReceiverPollMs)) continue;
+      try {
+        if (readStatus(vst, false) != READ_OK) continue;
+        if (History) History->push(vst);
+        Latest.publish(vst);
+      } catch (const std::exception &) {
+        // malformed json: skip the message, keep the thread alive
+      }
+    }
+  });
+  return true;
+}
+
+void CageAPI::stopReceiver() {
+  if (!Thread.joinable()) return;
+  isTerminated = true;
+  Thread.join();
+}
+
+void CageAPI::decodeStatus(const reportFields &f, vehicleStatus &vst) {
+  vst.simClock = f.time;
+  if (f.has(reportFields::LRPM)) vst.lrpm = f.lrpm;
+  if (f.has(reportFields::RRPM)) vst.rrpm = f.rrpm;
+  if (f.has(reportFields::ACCEL)) {
     // cm/s^2 -> m/s^2
-    vst.ax = static_cast<double>(a["X"]) / 100.;
-    vst.ay = static_cast<double>(a["Y"]) / 100. * -1.;
-    vst.az = static_cast<double>(a["Z"]) / 100.;
+    vst.ax = f.accel[0] / 100.;
+    vst.ay = f.accel[1] / 100. * -1.;
+    vst.az = f.accel[2] / 100.;
   }
   // [deg/s] -> [rad/s]
-  auto angVel = r.find("AngVel");
-  if (angVel != r.end()) {
-    Json av = *angVel;
-    vst.rx  = static_cast<double>(av["X"]) * M_PI / 180.;
-    vst.ry  = static_cast<double>(av["Y"]) * M_PI / 180. * -1.;
-    vst.rz  = static_cast<double>(av["Z"]) * M_PI / 180. * -1.;
-  }
-  auto pose = r.find("Pose");
-  if (pose != r.end()) {
-    Json p = *pose;
-    vst.ox = static_cast<double>(p["X"]);
-    vst.oy = static_cast<double>(p["Y"]) * -1.;
-    vst.oz = static_cast<double>(p["Z"]);
-    vst.ow = static_cast<double>(p["W"]) * -1.;
+  if (f.has(reportFields::ANGVEL)) {
+    vst.rx = f.angvel[0] * M_PI / 180.;
+    vst.ry = f.angvel[1] * M_PI / 180. * -1.;
+    vst.rz = f.angvel[2] * M_PI / 180. * -1.;
+  }
+  if (f.has(reportFields::POSE)) {
+    vst.ox = f.pose[0];
+    vst.oy = f.pose[1] * -1.;
+    vst.oz = f.pose[2];
+    vst.ow = f.pose[3] * -1.;
   }
   // location  +X +Y +Z [cm]  -> +X -Y +Z [m]
-  auto loc = r.find("Position");
-  if (loc != r.end()) {
-    Json l = *loc;
-    vst.wx = static_cast<double>(l["X"]) / 100.;
-    vst.wy = static_cast<double>(l["Y"]) / 100. * -1.;
-    vst.wz = static_cast<double>(l["Z"]) / 100.;
-  }
-  auto lat = r.find("lat");
-  if (lat != r.end()) {
-    Json b = *lat;
-    vst.latitude =
-        decode60({static_cast<double>(b["X"]), static_cast<double>(b["Y"]),
-                  static_cast<double>(b["Z"])});
-  }
-  auto lon = r.find("lon");
-  if (lon != r.end()) {
-    Json l = *lon;
-    vst.longitude =
-        decode60({static_cast<double>(l["X"]), static_cast<double>(l["Y"]),
-                  static_cast<double>(l["Z"])});
+  if (f.has(reportFields::POSITION)) {
+    vst.wx = f.position[0] / 100.;
+    vst.wy = f.position[1] / 100. * -1.;
+    vst.wz = f.position[2] / 100.;
   }
-  return true;
+  if (f.has(reportFields::LAT))
+    vst.latitude = decode60({f.lat[0], f.lat[1], f.lat[2]});
+  if (f.has(reportFields::LON))
+    vst.longitude = decode60({f.lon[0], f.lon[1], f.lon[2]});
+}
+
+std::string CageAPI::rpmCommand(double rpmL, double rpmR) {
+  commandEncoder e;
+  return std::string(e.rpm(rpmL, rpmR));
+}
+
+std::string CageAPI::vwCommand(double V, double W) {
+  commandEncoder e;
+  return std::string(e.vw(V, W));
+}
+
+std::string CageAPI::flwCommand(double F, double L, double W) {
+  commandEncoder e;
+  return std::string(e.flw(F, L, W));
 }
 
 bool CageAPI::setRpm(double rpmL, double rpmR) {
-  std::ostringstream os;
-  std::string        res;
-  os << "{\"CmdType\":\"RPM\",\"R\":" << rpmR << ",\"L\":" << rpmL << "}"
-     << std::endl;
-  if (!Console->sendActorMessage(Endpoint, os.str(), res)) {
+  Encoder.setBinary(BinaryAccepted);
+  Encoder.rpm(rpmL, rpmR);
+  return sendCommand();
+}
+
+bool CageAPI::setVW(double V, double W) {
+  Encoder.setBinary(BinaryAccepted);
+  Encoder.vw(V, W);
+  return sendCommand();
+}
+
+bool CageAPI::setFLW(double F, double L, double W) {
+  Encoder.setBinary(BinaryAccepted);
+  Encoder.flw(F, L, W);
+  return sendCommand();
+}
+
+bool CageAPI::sendCommand() {
+  if (Supervised && Session != SESSION_UP) {
+    // would block on a dead peer, or reach it after it came back
+    setError("Session down, reconnecting to " + ConsoleAddr);
+    return false;
+  }
+  if (Encoder.getEndpoint() != Endpoint) Encoder.bind(Endpoint);
+  if (AsyncConsole) {
+    // pipelined: the reply is handled later by poll() or flushCommands()
+    AsyncConsole->postActorMessage(Encoder);
+    if (AsyncConsole->getLastError().empty()) return true;
     setErrorStrm([&](auto &ost) {
       ost << " Failed to send actor command to " << Endpoint << " : "
-          << Console->getLastError();
+          << AsyncConsole->getLastError();
     });
     return false;
   }
-  return true;
-}
-
-bool CageAPI::setVW(double V, double W) {
-  std::ostringstream os;
-  std::string        res;
-  // m/s -> cm/s  deg/s -> rad/s
-  os << "{\"CmdType\":\"VW\",\"V\":" << V * 100 << ",\"W\":" << W * 180. / M_PI
-     << "}" << std::endl;
-  if (!Console->sendActorMessage(Endpoint, os.str(), res)) {
+  if (!Console->sendActorMessage(Encoder)) {
     setErrorStrm([&](auto &ost) {
       ost << " Failed to send actor command to " << Endpoint << " : "
           << Console->getLastError();
@@ -383,18 +1112,52 @@ bool CageAPI::setVW(double V, double W) {
   return true;
 }
 
-bool CageAPI::setFLW(double F, double L, double W) {
-  std::ostringstream os;
-  std::string        res;
-  // m/s -> cm/s  deg/s -> rad/s
-  os << "{\"CmdType\":\"VW\",\"V\":" << F * 100 << ",\"L\":" << L * 100
-     << ",\"W\":" << W * 180. / M_PI << "}" << std::endl;
-  if (!Console->sendActorMessage(Endpoint, os.str(), res)) {
-    setErrorStrm([&](auto &ost) {
-      ost << " Failed to send actor command to " << Endpoint << " : "
-          << Console->getLastError();
-    });
+void CageAPI::setLatencyStats(bool on) {
+  if (on && !Latency) Latency.reset(new latencyStats);
+  Timed = on;
+  attachLatency();
+}
+
+void CageAPI::attachLatency() {
+  latencyStats *l = Timed ? Latency.get() : nullptr;
+  if (Subscriber) Subscriber->setLatencyStats(l);
+  if (Console) Console->setLatencyStats(l);
+  if (AsyncConsole) AsyncConsole->setLatencyStats(l);
+}
+
+bool CageAPI::setAsyncCommands(bool on) {
+  AsyncCommands = on;
+  if (!on) {
+    if (AsyncConsole) flushCommands();
+    AsyncConsole.reset();
+    return true;
+  }
+  if (!ZCtx || AsyncConsole) return true;
+  AsyncConsole.reset(new simAsyncConsole(*ZCtx, ConsoleAddr));
+  if (Supervised && HeartbeatMs)
+    AsyncConsole->setHeartbeat(HeartbeatMs, 3 * HeartbeatMs);
+  AsyncConsole->setLatencyStats(Timed ? Latency.get() : nullptr);
+  if (!AsyncConsole->connect()) {
+    setError(AsyncConsole->getLastError());
+    AsyncConsole.reset();
     return false;
   }
   return true;
 }
+
+bool CageAPI::flushCommands(int timeout_ms) {
+  if (!AsyncConsole) return true;
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (AsyncConsole->queued() || AsyncConsole->inFlight()) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now())
+                    .count();
+    if (left <= 0) return false;
+    if (AsyncConsole->dispatch(static_cast<int>(left)) < 0) {
+      setError(AsyncConsole->getLastError());
+      return false;
+    }
+  }
+  return true;
+}
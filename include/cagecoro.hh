@@ -0,0 +1,627 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+// C++20 coroutine front end. A single threaded reactor drives console RPCs
+// (over simAsyncConsole) and status streams (over CageAPI / CageFleet), so
+// many of them can be in flight without blocking:
+//
+//   cageTask<> run(coConsole &con, coStatusStream &st) {
+//     std::vector<std::string> names;
+//     if (!co_await con.listEndpoints("Vehicle", names)) co_return;
+//     CageAPI::vehicleStatus vst;
+//     while (co_await st.nextStatus(vst)) { ... }
+//   }
+//   reactor.spawn(run(con, st));
+//   reactor.run();
+//
+// Needs -std=c++20. The reactor must outlive the consoles and streams
+// attached to it.
+#pragma once
+#if !defined(__cpp_impl_coroutine)
+#error "cagecoro.hh requires C++20 coroutines"
+#else
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cagefleet.hh"
+#include "cageclient.hh"
+
+class cageReactor;
+
+namespace cagecoro {
+struct promiseBase {
+  std::coroutine_handle<> Continuation;
+  std::exception_ptr      Exception;
+
+  struct finalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      auto c = h.promise().Continuation;
+      return c ? c : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  finalAwaiter        final_suspend() noexcept { return {}; }
+  void unhandled_exception() { Exception = std::current_exception(); }
+  void rethrow() {
+    if (Exception) std::rethrow_exception(Exception);
+  }
+};
+
+template <typename T>
+struct promiseValue : promiseBase {
+  std::optional<T> Value;
+  void             return_value(T v) { Value.emplace(std::move(v)); }
+  T                result() {
+    rethrow();
+    return std::move(*Value);
+  }
+};
+
+template <>
+struct promiseValue<void> : promiseBase {
+  void return_void() {}
+  void result() { rethrow(); }
+};
+}  // namespace cagecoro
+
+// Lazily started coroutine returning T. It runs when co_awaited from another
+// coroutine or when handed to cageReactor::spawn(). Exceptions escaping the
+// body are rethrown to the awaiter.
+template <typename T = void>
+class cageTask {
+public:
+  struct promise_type : cagecoro::promiseValue<T> {
+    cageTask get_return_object() {
+      return cageTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+  using handle = std::coroutine_handle<promise_type>;
+
+  cageTask() = default;
+  cageTask(cageTask &&o) noexcept : H(std::exchange(o.H, nullptr)) {}
+  cageTask &operator=(cageTask &&o) noexcept {
+    if (this != &o) {
+      reset();
+      H = std::exchange(o.H, nullptr);
+    }
+    return *this;
+  }
+  ~cageTask() { reset(); }
+
+  bool done() const { return !H || H.done(); }
+  // result of a finished task (see cageReactor::all). call once.
+  T    result() { return H.promise().result(); }
+
+  bool                    await_ready() const noexcept { return done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+    H.promise().Continuation = c;
+    return H;
+  }
+  T await_resume() { return H.promise().result(); }
+
+private:
+  friend class cageReactor;
+  handle H = nullptr;
+
+  explicit cageTask(handle h) : H(h) {}
+  void reset() {
+    if (H) H.destroy();
+    H = nullptr;
+  }
+};
+
+// Runs spawned tasks on the calling thread. Sockets are watched through
+// their ZMQ_FD; every watcher is pumped (and must drain its socket) on
+// each wakeup, so the edge triggered fds never go stale.
+class cageReactor {
+public:
+  using clock = std::chrono::steady_clock;
+
+  ~cageReactor();
+
+  void   spawn(cageTask<> t);
+  // resume h from the loop (not from the caller's stack)
+  void   schedule(std::coroutine_handle<> h) { Ready.push_back(h); }
+  size_t tasks() const { return Tasks.size(); }
+
+  // pump is called on every wakeup. returns an id for unwatch()
+  int  watch(zmq::fd_t fd, std::function<void()> pump);
+  void unwatch(int id);
+
+  // run until all spawned tasks have finished (true), or until deadline or
+  // stop() (false). an exception escaping a spawned task is rethrown here.
+  bool run() { return runUntil(clock::time_point::max()); }
+  bool runUntil(clock::time_point deadline);
+  void stop() { Stopped = true; }
+
+  struct sleepAwaiter {
+    cageReactor      &R;
+    clock::time_point T;
+    bool              await_ready() const { return clock::now() >= T; }
+    void await_suspend(std::coroutine_handle<> h) { R.Timers.push({T, h}); }
+    void await_resume() {}
+  };
+  sleepAwaiter sleepUntil(clock::time_point t) { return {*this, t}; }
+  template <typename Rep, typename Period>
+  sleepAwaiter sleepFor(std::chrono::duration<Rep, Period> d) {
+    return {*this, clock::now() + d};
+  }
+
+  // co_await all(tasks) runs the tasks concurrently and resumes when every
+  // one of them has finished; read the results with cageTask::result()
+  template <typename T>
+  struct joinAwaiter {
+    cageReactor             &R;
+    std::vector<cageTask<T>> &Tasks;
+    size_t                    Left = 0;
+    std::coroutine_handle<>   Waiter{};
+
+    bool await_ready() const { return Tasks.empty(); }
+    void await_suspend(std::coroutine_handle<> h) {
+      Waiter = h;
+      Left   = Tasks.size();
+      for (auto &t : Tasks) R.spawn(join(t.H, this));
+    }
+    void await_resume() {}
+
+    // waits for completion without consuming the result
+    struct completion {
+      typename cageTask<T>::handle H;
+      bool await_ready() const { return H.done(); }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) {
+        H.promise().Continuation = c;
+        return H;
+      }
+      void await_resume() {}
+    };
+    static cageTask<> join(typename cageTask<T>::handle h, joinAwaiter *j) {
+      co_await completion{h};
+      if (--j->Left == 0) j->R.schedule(j->Waiter);
+    }
+  };
+  template <typename T>
+  joinAwaiter<T> all(std::vector<cageTask<T>> &tasks) {
+    return {*this, tasks};
+  }
+
+private:
+  // upper bound of a wait, so that reply timeouts and status deadlines are
+  // checked without timers of their own
+  static constexpr int PollMs = 10;
+
+  struct source {
+    int                   id;
+    zmq::fd_t             fd;
+    std::function<void()> pump;
+  };
+  using timer = std::pair<clock::time_point, std::coroutine_handle<>>;
+  struct later {
+    bool operator()(const timer &a, const timer &b) const {
+      return a.first > b.first;
+    }
+  };
+
+  std::vector<cageTask<>>                                Tasks;
+  std::deque<std::coroutine_handle<>>                    Ready;
+  std::vector<source>                                    Sources;
+  std::priority_queue<timer, std::vector<timer>, later> Timers;
+  int                                                    NextId  = 1;
+  bool                                                   Stopped = false;
+
+  void reap();
+  void fireTimers();
+  void wait(clock::time_point deadline);
+};
+
+// Console RPCs as awaitables, pipelined over simAsyncConsole. The methods
+// mirror simConsole; getLastError() holds the error of the latest failure.
+class coConsole {
+public:
+  struct reply {
+    bool        ok;  // false on timeout
+    std::string data;
+  };
+  struct requestAwaiter {
+    coConsole               &C;
+    std::vector<std::string> Frames;
+    reply                    R{false, {}};
+
+    bool  await_ready() const { return false; }
+    void  await_suspend(std::coroutine_handle<> h);
+    reply await_resume() { return std::move(R); }
+  };
+
+  coConsole(cageReactor &reactor, zmq::context_t &ctx,
+            std::string server = "tcp://127.0.0.1:54323");
+  ~coConsole();
+  bool             connect();
+  std::string      getLastError() { return lastErr; }
+  simAsyncConsole &getAsyncConsole() { return Async; }
+
+  // co_await request(frames) -> reply
+  requestAwaiter request(std::vector<std::string> frames) {
+    return {*this, std::move(frames)};
+  }
+  cageTask<bool> listEndpoints(std::string tag, std::vector<std::string> &res);
+  cageTask<bool> getActorMetadata(std::string actor, Json &res);
+  cageTask<bool> execConsoleCommand(std::string command, std::string &res);
+  cageTask<bool> sendActorMessage(std::string endpoint, std::string command,
+                                  std::string &res);
+
+private:
+  // requests in flight at once; the console answers them in order
+  static constexpr size_t Window = 64;
+
+  cageReactor    &Reactor;
+  simAsyncConsole Async;
+  std::string     lastErr;
+  int             Watch = 0;
+
+  // Result of a reply into res, parsed and checked as simConsole does.
+  // false (with lastErr) unless there is one of the expected type
+  bool result(const reply &r, Json &res);
+  bool result(const reply &r, std::vector<std::string> &res);
+  bool result(const reply &r, std::string &res);
+  bool answered(const reply &r);  // false (with lastErr) on timeout
+};
+
+// Report streams as awaitables. coStatusStream follows the target vehicle
+// of a connected CageAPI, coFleetStream the vehicles of a CageFleet (it
+// takes over the fleet's handler). Every waiter of a stream receives the
+// next report; nextStatus() returns false on a receive error or when the
+// deadline passes.
+class coStatusStream {
+public:
+  using clock = std::chrono::steady_clock;
+  struct waiter {
+    coStatusStream         &S;
+    CageAPI::vehicleStatus &Out;
+    clock::time_point       Deadline;
+    bool                    Ok = false;
+    std::coroutine_handle<> H{};
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() { return Ok; }
+  };
+
+  coStatusStream(cageReactor &reactor, CageAPI &cage);
+  ~coStatusStream() { Reactor.unwatch(Watch); }
+
+  waiter nextStatus(CageAPI::vehicleStatus &vst,
+                    clock::time_point deadline = clock::time_point::max()) {
+    return {*this, vst, deadline};
+  }
+
+private:
+  cageReactor          &Reactor;
+  CageAPI              &Cage;
+  std::vector<waiter *> Waiters;
+  int                   Watch;
+
+  void pump();
+  void finish(waiter *w, bool ok);
+};
+
+class coFleetStream {
+public:
+  using clock = std::chrono::steady_clock;
+  struct waiter {
+    coFleetStream          &S;
+    CageFleet::vehicle     &V;
+    clock::time_point       Deadline;
+    bool                    Ok = false;
+    std::coroutine_handle<> H{};
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> h);
+    bool await_resume() { return Ok; }
+  };
+
+  coFleetStream(cageReactor &reactor, CageFleet &fleet);
+  ~coFleetStream();
+
+  // resumes with v.status holding the new report
+  waiter nextStatus(CageFleet::vehicle &v,
+                    clock::time_point   deadline = clock::time_point::max()) {
+    return {*this, v, deadline};
+  }
+
+private:
+  cageReactor          &Reactor;
+  CageFleet            &Fleet;
+  std::vector<waiter *> Waiters;
+  int                   Watch;
+
+  void pump();
+  void deliver(CageFleet::vehicle &v);
+  void finish(waiter *w, bool ok);
+};
+
+// ----------------------------------------------------------------
+
+cageReactor::~cageReactor() {
+  // unfinished frames are destroyed with their tasks
+  Tasks.clear();
+}
+
+void cageReactor::spawn(cageTask<> t) {
+  schedule(t.H);
+  Tasks.push_back(std::move(t));
+}
+
+int cageReactor::watch(zmq::fd_t fd, std::function<void()> pump) {
+  Sources.push_back(source{NextId, fd, std::move(pump)});
+  return NextId++;
+}
+
+void cageReactor::unwatch(int id) {
+  for (auto it = Sources.begin(); it != Sources.end(); ++it) {
+    if (it->id != id) continue;
+    Sources.erase(it);
+    return;
+  }
+}
+
+void cageReactor::reap() {
+  for (size_t i = 0; i < Tasks.size();) {
+    if (!Tasks[i].done()) {
+      ++i;
+      continue;
+    }
+    cageTask<> t = std::move(Tasks[i]);
+    Tasks.erase(Tasks.begin() + i);
+    t.result();  // rethrows
+  }
+}
+
+void cageReactor::fireTimers() {
+  auto now = clock::now();
+  while (!Timers.empty() && Timers.top().first <= now) {
+    schedule(Timers.top().second);
+    Timers.pop();
+  }
+}
+
+void cageReactor::wait(clock::time_point deadline) {
+  auto until =
+      std::min(deadline, clock::now() + std::chrono::milliseconds(PollMs));
+  if (!Timers.empty()) until = std::min(until, Timers.top().first);
+  auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+                  until - clock::now())
+                  .count();
+  if (left <= 0) return;
+  std::vector<zmq_pollitem_t> items;
+  for (const auto &s : Sources)
+    items.push_back(zmq_pollitem_t{nullptr, s.fd, ZMQ_POLLIN, 0});
+  zmq::poll(items, static_cast<long>((left + 999) / 1000));
+}
+
+bool cageReactor::runUntil(clock::time_point deadline) {
+  Stopped = false;
+  for (;;) {
+    while (!Ready.empty()) {
+      auto h = Ready.front();
+      Ready.pop_front();
+      h.resume();
+    }
+    reap();
+    if (Tasks.empty()) return true;
+    if (Stopped || clock::now() >= deadline) return false;
+    // watchers may schedule coroutines; wait only when nothing is ready
+    for (size_t i = 0; i < Sources.size(); ++i) Sources[i].pump();
+    fireTimers();
+    if (Ready.empty()) wait(deadline);
+  }
+}
+
+// ----------------------------------------------------------------
+
+coConsole::coConsole(cageReactor &reactor, zmq::context_t &ctx,
+                     std::string server)
+    : Reactor(reactor), Async(ctx, server) {
+  Async.setWindow(Window);
+}
+
+coConsole::~coConsole() {
+  if (Watch) Reactor.unwatch(Watch);
+}
+
+bool coConsole::connect() {
+  if (!Async.connect()) {
+    lastErr = Async.getLastError();
+    return false;
+  }
+  if (!Watch)
+    Watch = Reactor.watch(Async.getFd(), [this] {
+      if (Async.dispatch() < 0) lastErr = Async.getLastError();
+    });
+  lastErr.clear();
+  return true;
+}
+
+void coConsole::requestAwaiter::await_suspend(std::coroutine_handle<> h) {
+  C.Async.submit(std::move(Frames),
+                 [this, h](uint64_t, bool ok, const std::string &data) {
+                   R.ok   = ok;
+                   R.data = data;
+                   C.Reactor.schedule(h);
+                 });
+}
+
+bool coConsole::answered(const reply &r) {
+  if (r.ok) return true;
+  lastErr = "No response from console (timed out)";
+  return false;
+}
+
+bool coConsole::result(const reply &r, Json &res) {
+  if (!answered(r)) return false;
+  if (simConsole::parseResult(r.data, res)) return true;
+  lastErr = "Unexpected response:" + r.data;
+  return false;
+}
+
+bool coConsole::result(const reply &r, std::vector<std::string> &res) {
+  if (!answered(r)) return false;
+  if (simConsole::parseList(r.data, res)) return true;
+  lastErr = "Unexpected response:" + r.data;
+  return false;
+}
+
+bool coConsole::result(const reply &r, std::string &res) {
+  Json rj;
+  if (!answered(r)) return false;
+  if (simConsole::parseResult(r.data, rj) && rj.is_string()) {
+    res = rj.get<std::string>();
+    return true;
+  }
+  lastErr = "Unexpected response:" + r.data;
+  return false;
+}
+
+// frames and json are handled in the plain functions above: gcc 12 rejects
+// braced initializer lists inside coroutine bodies
+cageTask<bool> coConsole::listEndpoints(std::string               tag,
+                                        std::vector<std::string> &res) {
+  std::vector<std::string> req(
+      1, simConsole::request("ListEndpoint", "Tag", tag));
+  co_return result(co_await request(std::move(req)), res);
+}
+
+cageTask<bool> coConsole::getActorMetadata(std::string actor, Json &res) {
+  std::vector<std::string> req(
+      1, simConsole::request("GetActorMeta", "Endpoint", actor));
+  co_return result(co_await request(std::move(req)), res);
+}
+
+cageTask<bool> coConsole::execConsoleCommand(std::string  command,
+                                             std::string &res) {
+  std::vector<std::string> req(
+      1, simConsole::request("Console", "Input", command));
+  co_return result(co_await request(std::move(req)), res);
+}
+
+cageTask<bool> coConsole::sendActorMessage(std::string  endpoint,
+                                           std::string  command,
+                                           std::string &res) {
+  std::vector<std::string> req(
+      1, simConsole::request("ActorMsg", "Endpoint", endpoint));
+  req.push_back(std::move(command));
+  co_return result(co_await request(std::move(req)), res);
+}
+
+// ----------------------------------------------------------------
+
+coStatusStream::coStatusStream(cageReactor &reactor, CageAPI &cage)
+    : Reactor(reactor), Cage(cage) {
+  Watch = Reactor.watch(Cage.getFd(), [this] { pump(); });
+}
+
+bool coStatusStream::waiter::await_ready() {
+  // a report already queued is taken right away
+  if (S.Cage.tryGetStatus(Out)) return Ok = true;
+  return S.Cage.getErrorString().size() > 0;
+}
+
+void coStatusStream::waiter::await_suspend(std::coroutine_handle<> h) {
+  H = h;
+  S.Waiters.push_back(this);
+}
+
+void coStatusStream::finish(waiter *w, bool ok) {
+  w->Ok = ok;
+  Reactor.schedule(w->H);
+}
+
+void coStatusStream::pump() {
+  if (Waiters.empty()) {
+    // leave reports queued for the next waiter, but let zmq process its
+    // commands so that the fd is reset
+    Cage.getEvents();
+    return;
+  }
+  CageAPI::vehicleStatus vst;
+  if (Cage.tryGetStatus(vst)) {
+    for (auto w : Waiters) {
+      w->Out = vst;
+      finish(w, true);
+    }
+    Waiters.clear();
+    return;
+  }
+  bool failed = Cage.getErrorString().size() > 0;
+  auto now    = clock::now();
+  for (size_t i = 0; i < Waiters.size();) {
+    if (!failed && Waiters[i]->Deadline > now) {
+      ++i;
+      continue;
+    }
+    finish(Waiters[i], false);
+    Waiters.erase(Waiters.begin() + i);
+  }
+}
+
+// ----------------------------------------------------------------
+
+coFleetStream::coFleetStream(cageReactor &reactor, CageFleet &fleet)
+    : Reactor(reactor), Fleet(fleet) {
+  Fleet.setHandler([this](CageFleet::vehicle &v) { deliver(v); });
+  Watch = Reactor.watch(Fleet.getSubscriber().getFd(), [this] { pump(); });
+}
+
+coFleetStream::~coFleetStream() {
+  Fleet.setHandler(nullptr);
+  Reactor.unwatch(Watch);
+}
+
+void coFleetStream::waiter::await_suspend(std::coroutine_handle<> h) {
+  H = h;
+  S.Waiters.push_back(this);
+}
+
+void coFleetStream::finish(waiter *w, bool ok) {
+  w->Ok = ok;
+  Reactor.schedule(w->H);
+}
+
+void coFleetStream::deliver(CageFleet::vehicle &v) {
+  for (size_t i = 0; i < Waiters.size();) {
+    if (&Waiters[i]->V != &v) {
+      ++i;
+      continue;
+    }
+    finish(Waiters[i], true);
+    Waiters.erase(Waiters.begin() + i);
+  }
+}
+
+void coFleetStream::pump() {
+  // reports are always drained: the fleet keeps the newest status of every
+  // vehicle anyway
+  bool failed = Fleet.poll(0) < 0;
+  auto now    = clock::now();
+  for (size_t i = 0; i < Waiters.size();) {
+    if (!failed && Waiters[i]->Deadline > now) {
+      ++i;
+      continue;
+    }
+    finish(Waiters[i], false);
+    Waiters.erase(Waiters.begin() + i);
+  }
+}
+#endif
@@ -0,0 +1,422 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "cageclient.hh"
+
+// Several vehicles over one context, one subscriber and one console
+// connection. Every report is decoded once and handed to the vehicle named
+// in it; commands of all vehicles share the console socket.
+class CageFleet {
+public:
+  class vehicle {
+  public:
+    CageAPI::vehicleInfo   info;
+    CageAPI::vehicleStatus status{};  // newest status
+    uint64_t               seq = 0;   // number of reports received
+
+    // sent at once, or staged until sendBatch() during a batch
+    bool setRpm(double rpmL, double rpmR) {
+      Encoder.rpm(rpmL, rpmR);
+      return Fleet->sendCommand(*this);
+    }
+    bool setVW(double V, double W) {
+      Encoder.vw(V, W);
+      return Fleet->sendCommand(*this);
+    }
+    bool setFLW(double F, double L, double W) {
+      Encoder.flw(F, L, W);
+      return Fleet->sendCommand(*this);
+    }
+
+  private:
+    friend class CageFleet;
+    CageFleet     *Fleet = nullptr;
+    commandEncoder Encoder;  // bound to info.name
+    bool           Staged = false;
+  };
+  // called from poll() for every report, after the status is updated
+  using handler = std::function<void(vehicle &)>;
+
+  // peerAddr: simulator address
+  CageFleet(std::string peerAddr);
+  ~CageFleet() {
+    flushCommands();
+    reset();
+  }
+
+  // restrict the fleet to these vehicles; all vehicles when none is given.
+  // takes effect on the next connect()
+  void        addVehicle(std::string name) { Wanted.insert(name); }
+  void        setTopicSubscription(bool on) { TopicSubscription = on; }
+  // send commands through simAsyncConsole (see CageAPI::setAsyncCommands).
+  // takes effect on the next connect()
+  void        setAsyncCommands(bool on) { AsyncCommands = on; }
+  bool        connect();
+  bool        isValid() { return ZCtx && Console && Subscriber; }
+  std::string getErrorString() { return ErrorString; }
+
+  size_t   size() const { return Vehicles.size(); }
+  vehicle &operator[](size_t i) { return *Vehicles[i]; }
+  // nullptr if the vehicle is not in the fleet
+  vehicle *find(std::string_view name);
+  void     setHandler(handler h) { Handler = std::move(h); }
+
+  // wait up to timeout_ms for reports, then dispatch everything queued.
+  // returns the number of reports dispatched, or -1 on error.
+  int      poll(int timeout_ms = -1);
+  int      pollUntil(std::chrono::steady_clock::time_point deadline);
+  bool     flushCommands(int timeout_ms = 1000);
+  uint64_t getDropped() const { return Dropped; }
+
+  // Batched commands. After beginBatch(), vehicle::setRpm/setVW/setFLW only
+  // encode their setpoint (a newer one replaces it). sendBatch() ends the
+  // batch and sends the staged setpoints of all vehicles in one
+  // ActorMsgBatch request with one aggregated reply, so a control tick
+  // costs one round trip whatever the fleet size. A console that does not
+  // know ActorMsgBatch gets the commands one by one from then on (see
+  // isBatchSupported()).
+  void beginBatch() { Batching = true; }
+  bool sendBatch();
+  bool isBatchSupported() const { return !NoBatch; }
+
+  simConsole    &getConsole() { return *Console; }
+  simSubscriber &getSubscriber() { return *Subscriber; }
+
+  CageAPI::worldInfo WorldInfo{};
+
+private:
+  std::unique_ptr<zmq::context_t>       ZCtx;
+  std::string                           ReporterAddr, ConsoleAddr;
+  std::string                           ErrorString;
+  std::set<std::string>                 Wanted;
+  bool                                  TopicSubscription = false;
+  bool                                  AsyncCommands     = false;
+  std::unique_ptr<simSubscriber>        Subscriber;
+  std::unique_ptr<simConsole>           Console;
+  std::unique_ptr<simAsyncConsole>      AsyncConsole;
+  std::vector<std::unique_ptr<vehicle>> Vehicles;
+  handler                               Handler;
+  uint64_t                              Dropped  = 0;
+  bool                                  Batching = false, NoBatch = false;
+  std::vector<vehicle *>                Staged;    // of the current batch
+  std::vector<commandEncoder *>         Encoders;  // of Staged, for sending
+  // connect(): requests in flight at once, time limit [ms]
+  static constexpr size_t HandshakeWindow    = 64;
+  static constexpr int    HandshakeTimeoutMs = 2000;
+  // report name -> vehicle; keys are views of vehicle::info.name
+  std::unordered_map<std::string_view, vehicle *> ByName;
+
+  int  drain();
+  bool dispatch(const zmq::message_t &msg);
+  bool sendCommand(vehicle &v);
+  // a batch over the async console; commands are sent one by one when the
+  // console turns out not to know ActorMsgBatch
+  void postBatch();
+  // the async console before the vehicles: queued requests refer to their
+  // encoders
+  void reset();
+};
+
+// ----------------------------------------------------------------
+
+CageFleet::CageFleet(std::string peerAddr) {
+  ReporterAddr = "tcp://" + peerAddr + ":54321";
+  ConsoleAddr  = "tcp://" + peerAddr + ":54323";
+}
+
+void CageFleet::reset() {
+  ByName.clear();
+  Staged.clear();
+  Batching = false;
+  Subscriber.reset();
+  AsyncConsole.reset();
+  Console.reset();
+  ZCtx.reset();
+  Vehicles.clear();
+}
+
+bool CageFleet::connect() {
+  reset();
+  ZCtx.reset(new zmq::context_t(1));
+  if (!ZCtx->isValid()) {
+    std::ostringstream os;
+    os << "Cannot create zcontext:" << zmq_strerror(zmq_errno());
+    ErrorString = os.str();
+    reset();
+    return false;
+  }
+  Console.reset(new simConsole(*ZCtx, ConsoleAddr));
+  if (!Console->connect()) {
+    ErrorString = Console->getLastError();
+    reset();
+    return false;
+  }
+
+  Subscriber.reset(new simSubscriber(*ZCtx, ReporterAddr));
+  // reports are filtered by the name lookup in dispatch(); target actors are
+  // needed only as topic prefixes. connected before the handshake so that
+  // reports are buffered meanwhile
+  Subscriber->setTopicMode(TopicSubscription);
+  if (!Subscriber->connect()) {
+    ErrorString = Subscriber->getLastError();
+    reset();
+    return false;
+  }
+
+  // all metadata requests are in flight at once (see CageAPI::connect)
+  std::unique_ptr<simAsyncConsole> hs(new simAsyncConsole(*ZCtx, ConsoleAddr));
+  if (!hs->connect()) {
+    ErrorString = hs->getLastError();
+    hs.reset();
+    reset();
+    return false;
+  }
+  hs->setWindow(HandshakeWindow);
+  bool                     listed = false;
+  std::vector<std::string> failed;
+  hs->listEndpoints("Vehicle", [&](bool ok, std::vector<std::string> &res) {
+    listed = ok;
+    for (const auto &e : res) {
+      if (Wanted.size() && !Wanted.count(e)) continue;
+      std::unique_ptr<vehicle> v(new vehicle);
+      v->Fleet     = this;
+      v->info.name = e;
+      vehicle *p   = v.get();
+      Vehicles.push_back(std::move(v));
+      hs->getActorMetadata(e, [&failed, p](bool ok, Json &meta) {
+        CageAPI::vehicleInfo info = p->info;
+        try {
+          if (ok) CageAPI::parseVehicleInfo(p->info.name, meta, info);
+        } catch (const Json::exception &) {
+          ok = false;  // malformed
+        }
+        if (ok)
+          p->info = std::move(info);
+        else
+          failed.push_back(p->info.name);
+      });
+    }
+  });
+  WorldInfo.valid = false;
+  hs->listEndpoints("GeoReference", [&](bool ok,
+                                       std::vector<std::string> &res) {
+    if (!ok || res.empty()) return;
+    hs->getActorMetadata(res[0], [this](bool ok, Json &grMeta) {
+      CageAPI::worldInfo world{};
+      try {
+        if (ok) CageAPI::parseWorldInfo(grMeta, world);
+      } catch (const Json::exception &) {
+        return;  // WorldInfo stays invalid
+      }
+      WorldInfo = world;
+    });
+  });
+  bool done = hs->wait(HandshakeTimeoutMs);
+  // handlers of unanswered requests refer to this frame. the socket must be
+  // gone before reset() terminates the context
+  if (AsyncCommands && done)
+    AsyncConsole = std::move(hs);
+  else
+    hs.reset();
+
+  if (!listed) {
+    ErrorString = "Unable to get endpoint list: no valid response from [" +
+                  ConsoleAddr + "]";
+    reset();
+    return false;
+  }
+  if (Vehicles.empty()) {
+    ErrorString = "No matching vehicle found.";
+    reset();
+    return false;
+  }
+  if (!done || failed.size()) {
+    ErrorString = "Failed to fetch vehicle metadata of " +
+                  (failed.size() ? failed[0] : Vehicles.back()->info.name);
+    reset();
+    return false;
+  }
+  for (const auto &v : Vehicles) {
+    ByName.emplace(v->info.name, v.get());
+    v->Encoder.bind(v->info.name);
+    if (TopicSubscription) Subscriber->addTargetActor(v->info.name);
+  }
+  // no allocation per batch
+  Staged.reserve(Vehicles.size());
+  Encoders.reserve(Vehicles.size());
+
+  if (AsyncCommands && !AsyncConsole) {
+    AsyncConsole.reset(new simAsyncConsole(*ZCtx, ConsoleAddr));
+    if (!AsyncConsole->connect()) {
+      ErrorString = AsyncConsole->getLastError();
+      reset();
+      return false;
+    }
+  }
+  ErrorString.clear();
+  return true;
+}
+
+CageFleet::vehicle *CageFleet::find(std::string_view name) {
+  auto it = ByName.find(name);
+  return it == ByName.end() ? nullptr : it->second;
+}
+
+int CageFleet::poll(int timeout_ms) {
+  if (!isValid()) {
+    ErrorString = "Not connected.";
+    return -1;
+  }
+  if (AsyncConsole) AsyncConsole->dispatch();
+  if (!Subscriber->waitFor(timeout_ms)) return 0;
+  return drain();
+}
+
+int CageFleet::pollUntil(std::chrono::steady_clock::time_point deadline) {
+  if (!isValid()) {
+    ErrorString = "Not connected.";
+    return -1;
+  }
+  if (AsyncConsole) AsyncConsole->dispatch();
+  if (!Subscriber->waitUntil(deadline)) return 0;
+  return drain();
+}
+
+int CageFleet::drain() {
+  int            n = 0;
+  zmq::message_t msg;
+  while (Subscriber->recvRaw(msg, ZMQ_DONTWAIT)) {
+    if (dispatch(msg)) ++n;
+  }
+  if (Subscriber->getLastError().size()) {
+    ErrorString = Subscriber->getLastError();
+    return -1;
+  }
+  return n;
+}
+
+bool CageFleet::dispatch(const zmq::message_t &msg) {
+  const char      *data  = msg.data<char>();
+  std::string_view topic = Subscriber->lastTopic();
+  vehicle         *v     = nullptr;
+  if (topic.size() && !(v = find(topic))) {
+    ++Dropped;
+    return false;
+  }
+  reportFields f;
+  Json         j;  // owns the strings f refers to on the fallback path
+  if (!reportDecoder::decode(data, msg.size(), f)) {
+    try {
+      j = Json::parse(data, data + msg.size());
+      if (j.count("Report")) reportDecoder::fromJson(j["Report"], f);
+    } catch (const std::exception &) {
+      // malformed json: dropped below
+    }
+  }
+  if (!v) v = find(f.name);
+  if (!v || !f.has(reportFields::DATA | reportFields::TIME)) {
+    ++Dropped;
+    return false;
+  }
+  CageAPI::decodeStatus(f, v->status);
+  ++v->seq;
+  if (Handler) Handler(*v);
+  return true;
+}
+
+bool CageFleet::sendCommand(vehicle &v) {
+  if (Batching) {
+    if (!v.Staged) Staged.push_back(&v);
+    v.Staged = true;
+    return true;
+  }
+  const std::string &endpoint = v.info.name;
+  if (AsyncConsole) {
+    AsyncConsole->postActorMessage(v.Encoder);
+    if (AsyncConsole->getLastError().empty()) return true;
+    ErrorString = " Failed to send actor command to " + endpoint + " : " +
+                  AsyncConsole->getLastError();
+    return false;
+  }
+  if (!Console || !Console->sendActorMessage(v.Encoder)) {
+    ErrorString = " Failed to send actor command to " + endpoint + " : " +
+                  (Console ? Console->getLastError() : "Not connected.");
+    return false;
+  }
+  return true;
+}
+
+bool CageFleet::sendBatch() {
+  Batching = false;
+  if (Staged.empty()) return true;
+  // the async reply may arrive (and resend the batch) within postBatch()
+  bool ok = true, oneByOne = NoBatch;
+  Encoders.clear();
+  for (auto v : Staged) Encoders.push_back(&v->Encoder);
+  if (AsyncConsole && !oneByOne) {
+    postBatch();
+    if (AsyncConsole->getLastError().size()) {
+      ErrorString = " Failed to send actor commands: " +
+                    AsyncConsole->getLastError();
+      ok = false;
+    }
+  } else if (!oneByOne && Console) {
+    if (!Console->sendActorMessages(Encoders.data(), Encoders.size())) {
+      if (Console->getLastError().size()) {
+        ErrorString = " Failed to send actor commands: " +
+                      Console->getLastError();
+        ok = false;
+      } else {
+        NoBatch = oneByOne = true;  // sent one by one below
+      }
+    }
+  }
+  if (oneByOne)
+    for (auto v : Staged) ok = sendCommand(*v) && ok;
+  for (auto v : Staged) v->Staged = false;
+  Staged.clear();
+  return ok;
+}
+
+void CageFleet::postBatch() {
+  // the commands are not copied; the encoders stay with their vehicles
+  AsyncConsole->postActorMessages(
+      Encoders.data(), Encoders.size(),
+      [this, sent = Encoders](uint64_t, bool ok, const std::string &reply) {
+        if (!ok || !simConsole::isResultString(reply)) return;
+        // ActorMsgBatch is unknown: these (with their newest setpoints) and
+        // later commands one by one
+        NoBatch = true;
+        for (auto enc : sent) AsyncConsole->postActorMessage(*enc);
+      });
+}
+
+bool CageFleet::flushCommands(int timeout_ms) {
+  if (!AsyncConsole) return true;
+  auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (AsyncConsole->queued() || AsyncConsole->inFlight()) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now())
+                    .count();
+    if (left <= 0) return false;
+    if (AsyncConsole->dispatch(static_cast<int>(left)) < 0) {
+      ErrorString = AsyncConsole->getLastError();
+      return false;
+    }
+  }
+  return true;
+}
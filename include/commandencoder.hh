@@ -0,0 +1,238 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+
+#include "wireformat.hh"
+#include "zmq_nt.hpp"
+
+// ActorMsg frames of setRpm/setVW/setFLW without allocation. The envelope
+// of the bound endpoint is built once by bind(); commands are written into
+// a fixed buffer with std::to_chars (shortest round trip, independent of
+// the locale). send() hands both buffers to libzmq without copying them.
+//
+// The buffers are reference counted: libzmq holds a reference to each sent
+// frame until it is done with it (zmq_msg_init_data with a free function),
+// so encoding again while a frame is still in use moves to another one of
+// a few buffers. Once all of them are in use, the oldest is left to libzmq
+// and replaced by a new one; it is freed when libzmq releases it. Steady
+// request/reply traffic therefore does not allocate, and the encoder may be
+// destroyed at any time.
+class commandEncoder {
+public:
+  // the longest command, flw() with three 24 character numbers, is 104
+  static constexpr size_t Capacity = 128;
+
+  commandEncoder();
+  ~commandEncoder();
+  commandEncoder(const commandEncoder &)            = delete;
+  commandEncoder &operator=(const commandEncoder &) = delete;
+
+  // same text as simConsole::request("ActorMsg", "Endpoint", endpoint)
+  void               bind(const std::string &endpoint);
+  const std::string &getEndpoint() const { return Endpoint; }
+  std::string_view   envelope() const {
+    return Envelope ? std::string_view(Envelope->data(), Envelope->size)
+                    : std::string_view();
+  }
+  // encode commands in the binary format (wireformat.hh) instead of JSON,
+  // once the console accepted it
+  void               setBinary(bool on) { Binary = on; }
+  bool               isBinary() const { return Binary; }
+
+  // encode a command payload; the view is valid until the next one
+  std::string_view rpm(double rpmL, double rpmR);
+  std::string_view vw(double V, double W);  // [m/s], [rad/s]
+  std::string_view flw(double F, double L, double W);
+  std::string_view command() const {
+    return std::string_view(Bufs[Current]->data(), Bufs[Current]->size);
+  }
+
+  // send [envelope][command] on a REQ socket. >= 0 on success, -errno
+  // otherwise (see socket_t::send)
+  int send(zmq::socket_t &sock, int flags = 0);
+
+private:
+  // reference counted buffer shared with libzmq, data follows the header
+  struct block {
+    std::atomic<int> refs{1};
+    size_t           size = 0;
+
+    char         *data() { return reinterpret_cast<char *>(this + 1); }
+    static block *create(size_t capacity);
+    // drop a reference; also the zmq free function (block in hint)
+    static void   release(void *, void *hint);
+  };
+  static constexpr size_t Buffers = 4;
+
+  std::string Endpoint;
+  block      *Envelope = nullptr;
+  block      *Bufs[Buffers]{};
+  size_t      Current = 0;
+  bool        Binary  = false;
+
+  // make Bufs[Current] a buffer libzmq does not read
+  void acquire();
+
+  struct writer {
+    char *p, *end;
+    void  put(std::string_view s);
+    void  num(double v);
+  };
+  template <typename F>
+  std::string_view encode(F f);
+  std::string_view encode(const cagewire::command &c);
+};
+
+// ----------------------------------------------------------------
+
+commandEncoder::block *commandEncoder::block::create(size_t capacity) {
+  return new (::operator new(sizeof(block) + capacity)) block;
+}
+
+void commandEncoder::block::release(void *, void *hint) {
+  auto b = static_cast<block *>(hint);
+  if (b && b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    b->~block();
+    ::operator delete(b);
+  }
+}
+
+commandEncoder::commandEncoder() {
+  for (auto &b : Bufs) b = block::create(Capacity);
+}
+
+commandEncoder::~commandEncoder() {
+  block::release(nullptr, Envelope);
+  for (auto b : Bufs) block::release(nullptr, b);
+}
+
+void commandEncoder::acquire() {
+  auto idle = [](block *b) {
+    return b->refs.load(std::memory_order_acquire) == 1;
+  };
+  if (idle(Bufs[Current])) return;
+  for (size_t i = 1; i < Buffers; ++i) {
+    size_t k = (Current + i) % Buffers;
+    if (idle(Bufs[k])) {
+      Current = k;
+      return;
+    }
+  }
+  // all in flight (replies lost?): leave the next one to libzmq
+  Current = (Current + 1) % Buffers;
+  block::release(nullptr, Bufs[Current]);
+  Bufs[Current] = block::create(Capacity);
+}
+
+void commandEncoder::bind(const std::string &endpoint) {
+  std::string env = "{\n\"Type\" :  \"ActorMsg\",\n\"Endpoint\" : \"" +
+                    endpoint + "\"\n}";
+  // the old envelope stays valid while libzmq holds it
+  block::release(nullptr, Envelope);
+  Envelope = block::create(env.size());
+  memcpy(Envelope->data(), env.data(), env.size());
+  Envelope->size = env.size();
+  Endpoint       = endpoint;
+}
+
+void commandEncoder::writer::put(std::string_view s) {
+  size_t n = std::min(s.size(), static_cast<size_t>(end - p));
+  memcpy(p, s.data(), n);
+  p += n;
+}
+
+void commandEncoder::writer::num(double v) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  auto r = std::to_chars(p, end, v);
+  if (r.ec == std::errc()) p = r.ptr;
+#else
+  // no floating point to_chars (older libc++): enough digits to round trip
+  int n = std::snprintf(p, end - p, "%.17g", v);
+  if (n > 0) p += std::min(static_cast<ptrdiff_t>(n), end - p - 1);
+#endif
+}
+
+template <typename F>
+std::string_view commandEncoder::encode(F f) {
+  acquire();
+  char  *buf = Bufs[Current]->data();
+  writer w{buf, buf + Capacity};
+  f(w);
+  // kept from the ostream versions, which ended with std::endl
+  w.put("}\n");
+  Bufs[Current]->size = static_cast<size_t>(w.p - buf);
+  return command();
+}
+
+std::string_view commandEncoder::encode(const cagewire::command &c) {
+  acquire();
+  Bufs[Current]->size = cagewire::encodeCommand(c, Bufs[Current]->data());
+  return command();
+}
+
+std::string_view commandEncoder::rpm(double rpmL, double rpmR) {
+  if (Binary) return encode({cagewire::CMD_RPM, {rpmL, rpmR, 0}});
+  return encode([&](writer &w) {
+    w.put("{\"CmdType\":\"RPM\",\"R\":");
+    w.num(rpmR);
+    w.put(",\"L\":");
+    w.num(rpmL);
+  });
+}
+
+std::string_view commandEncoder::vw(double V, double W) {
+  // m/s -> cm/s  rad/s -> deg/s
+  if (Binary) return encode({cagewire::CMD_VW, {V * 100, 0, W * 180. / M_PI}});
+  return encode([&](writer &w) {
+    w.put("{\"CmdType\":\"VW\",\"V\":");
+    w.num(V * 100);
+    w.put(",\"W\":");
+    w.num(W * 180. / M_PI);
+  });
+}
+
+std::string_view commandEncoder::flw(double F, double L, double W) {
+  // m/s -> cm/s  rad/s -> deg/s
+  if (Binary)
+    return encode({cagewire::CMD_VW, {F * 100, L * 100, W * 180. / M_PI}});
+  return encode([&](writer &w) {
+    w.put("{\"CmdType\":\"VW\",\"V\":");
+    w.num(F * 100);
+    w.put(",\"L\":");
+    w.num(L * 100);
+    w.put(",\"W\":");
+    w.num(W * 180. / M_PI);
+  });
+}
+
+int commandEncoder::send(zmq::socket_t &sock, int flags) {
+  if (!Envelope) return -EINVAL;  // not bound
+  block *b = Bufs[Current];
+  // one reference per message, dropped by libzmq when done with the frame
+  // (or by the message destructor if it was not sent)
+  Envelope->refs.fetch_add(1, std::memory_order_relaxed);
+  zmq::message_t env(Envelope->data(), Envelope->size, block::release,
+                     Envelope);
+  b->refs.fetch_add(1, std::memory_order_relaxed);
+  zmq::message_t cmd(b->data(), b->size, block::release, b);
+  int            err = sock.send(env, flags | ZMQ_SNDMORE);
+  if (err < 0) return err;
+  return sock.send(cmd, flags);
+}
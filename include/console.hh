@@ -7,8 +7,11 @@ http://opensource.org/licenses/mit-license.php
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <string_view>
 
+#include "commandencoder.hh"
 #include "json.hh"
+#include "latency.hh"
 #include "zmq_nt.hpp"
 
 
@@ -20,19 +23,89 @@ public:
   void        close();
   bool        isValid() { return Sock && Sock->isValid(); }
   std::string getLastError() { return lastErr; }
+  // ZMTP heartbeats (libzmq 4.2+): the connection is dropped and retried
+  // when the peer is silent for timeout_ms. must be set before connect()
+  bool        setHeartbeat(int ivl_ms, int timeout_ms);
+  // report connection events of the socket to mon (see CageAPI
+  // supervision). call before connect() to see the first connection
+  bool        startMonitor(zmq::monitor_t &mon, const std::string &addr,
+                           int events = ZMQ_EVENT_CONNECTED |
+                                        ZMQ_EVENT_DISCONNECTED);
   bool        submitRequest(std::string req, std::string &res);
   bool        submitRequest(std::vector<std::string> req, std::string &res);
+  // res views the reply in the socket's receive message, valid until the
+  // next request
+  bool        submitRequest(const std::string &req, std::string_view &res);
+  bool        submitRequest(const std::vector<std::string> &req,
+                            std::string_view                &res);
+
+  // Non-blocking halves of submitRequest for external event loops. The
+  // socket is REQ: each trySend must be followed by tryRecv of its reply
+  // (a new trySend drops an unanswered request). Both return false without
+  // an error set when they would block.
+  bool      trySend(std::vector<std::string> req);
+  bool      tryRecv(std::string &res);
+  bool      tryRecv(std::string_view &res);
+  // ZMQ_FD / ZMQ_EVENTS; see simSubscriber::getFd for the edge triggered
+  // semantics
+  zmq::fd_t getFd() const { return Sock->getsockopt<zmq::fd_t>(ZMQ_FD); }
+  uint32_t  getEvents() const {
+    return Sock->getsockopt<uint32_t>(ZMQ_EVENTS);
+  }
 
   bool listEndpoints(std::string tag, std::vector<std::string> &res);
   bool getActorMetadata(std::string actor, Json &res);
   bool execConsoleCommand(std::string command, std::string &res);
   bool sendActorMessage(std::string endpoint, std::string command,
                         std::string &res);
+  // send the last command encoded by enc to its bound endpoint. Replies of
+  // the usual {"Result":"..."} form are checked without parsing, so this
+  // does not allocate
+  bool sendActorMessage(commandEncoder &enc);
+  // the commands last encoded by n encoders in one ActorMsgBatch request
+  // [BatchRequest][envelope 1][command 1]...[envelope n][command n], and
+  // one reply {"Result":[result 1, ..., result n]}. false without an error
+  // set when the console answered but does not know ActorMsgBatch
+  bool sendActorMessages(commandEncoder *const *enc, size_t n);
+
+  // protocol helpers, shared with simAsyncConsole.
+  static constexpr const char *BatchRequest =
+      "{\n\"Type\" :  \"ActorMsgBatch\"\n}";
+  // {"Type": type, key: value}
+  static std::string request(const char *type, const char *key,
+                             const std::string &value);
+  // "Result" of a reply; false if there is none
+  static bool        parseResult(std::string_view reply, Json &res);
+  // true if reply starts with {"Result":" (checked without parsing)
+  static bool        isResultString(std::string_view reply);
+  // appends the "Result" array of a reply
+  static bool        parseList(std::string_view          reply,
+                               std::vector<std::string> &res);
+
+  // time request sends (SEND) and replies (REPLY) into stats; nullptr stops
+  void setLatencyStats(latencyStats *stats) { Latency = stats; }
 
 protected:
-  std::unique_ptr<zmq::socket_t> Sock;
-  std::string                    Server;
-  std::string                    lastErr;
+  std::unique_ptr<zmq::socket_t>  Sock;
+  std::string                     Server;
+  std::string                     lastErr;
+  latencyStats                   *Latency = nullptr;
+  latencyStats::clock::time_point SentAt;  // of the last request
+  zmq::message_t                  Reply;   // reused for every reply
+
+  // send n frames and receive the reply into Reply
+  bool exchange(const std::string *req, size_t n);
+  // receive the reply of a sent request into Reply
+  bool receive();
+
+  // SEND from t0 to now; marks the start of REPLY
+  void sent(latencyStats::clock::time_point t0) {
+    SentAt = latencyStats::clock::now();
+    Latency->record(latencyStats::SEND, t0, SentAt);
+  }
+  void replied() {
+    Latency->record(latencyStats::REPLY, SentAt, latencyStats::clock::now());
+  }
 };
 
 simConsole::simConsole(zmq::context_t &ctx, std::string server)
@@ -59,130 +132,294 @@ bool simConsole::connect() {
 
 void simConsole::close() { if(!Sock) return; Sock->close(); Sock.release(); }
 
-bool simConsole::execConsoleCommand(std::string command, std::string &res) {
+std::string simConsole::request(const char *type, const char *key,
+                                const std::string &value) {
   std::ostringstream os;
   os << "{\n"
-     << "\"Type\" :  \"Console\",\n"
-     << "\"Input\" : \"" << command << "\"\n"
+     << "\"Type\" :  \"" << type << "\",\n"
+     << "\"" << key << "\" : \"" << value << "\"\n"
      << "}";
-  std::string r;
-  if (!submitRequest(os.str(), r)) return false;
+  return os.str();
+}
 
-  auto rj = Json::parse(r);
-  if (rj.count("Result") || rj["Result"].is_string()) {
-    res = rj["Result"];
+bool simConsole::parseResult(std::string_view reply, Json &res) {
+  Json rj = Json::parse(reply.begin(), reply.end(), nullptr, false);
+  if (rj.is_discarded() || !rj.count("Result")) return false;
+  res = std::move(rj["Result"]);
+  return true;
+}
+
+bool simConsole::parseList(std::string_view          reply,
+                           std::vector<std::string> &res) {
+  Json r;
+  if (!parseResult(reply, r) || !r.is_array()) return false;
+  for (Json::iterator it = r.begin(), ec = r.end(); it != ec; ++it) {
+    res.push_back(*it);
+  }
+  return true;
+}
+
+bool simConsole::execConsoleCommand(std::string command, std::string &res) {
+  std::string_view r;
+  if (!submitRequest(request("Console", "Input", command), r)) return false;
+
+  Json rj;
+  if (parseResult(r, rj) && rj.is_string()) {
+    res = rj;
     lastErr.clear();
     return true;
   }
-  lastErr = "Unexpected response:" + r;
+  lastErr = "Unexpected response:" + std::string(r);
   return false;
 }
 bool simConsole::sendActorMessage(std::string endpoint, std::string command,
                                   std::string &res) {
-  std::ostringstream os;
-  os << "{\n"
-     << "\"Type\" :  \"ActorMsg\",\n"
-     << "\"Endpoint\" : \"" << endpoint << "\"\n"
-     << "}";
-  std::string r;
-  if (!submitRequest(std::vector<std::string>{os.str(), command}, r))
+  std::string_view r;
+  if (!submitRequest(std::vector<std::string>{
+                         request("ActorMsg", "Endpoint", endpoint), command},
+                     r))
+    return false;
+
+  Json rj;
+  if (parseResult(r, rj) && rj.is_string()) {
+    res = rj;
+    lastErr.clear();
+    return true;
+  }
+  lastErr = "Unexpected response:" + std::string(r);
+  return false;
+}
+
+bool simConsole::sendActorMessage(commandEncoder &enc) {
+  latencyStats::clock::time_point t0;
+  if (Latency) t0 = latencyStats::clock::now();
+  auto err = enc.send(*Sock);
+  if (err < 0) {
+    std::ostringstream os;
+    os << "Could not send command to [" << Server
+       << "] :" << zmq_strerror(-err);
+    lastErr = os.str();
     return false;
+  }
+  if (Latency) sent(t0);
+  if (!receive()) return false;
 
-  auto rj = Json::parse(r);
-  if (rj.count("Result") || rj["Result"].is_string()) {
-    res = rj["Result"];
+  std::string_view r = Reply.view();
+  Json             rj;
+  if (isResultString(r) || (parseResult(r, rj) && rj.is_string())) {
     lastErr.clear();
     return true;
   }
-  lastErr = "Unexpected response:" + r;
+  lastErr = "Unexpected response:" + std::string(r);
   return false;
 }
 
+bool simConsole::sendActorMessages(commandEncoder *const *enc, size_t n) {
+  if (n == 0) {
+    lastErr.clear();
+    return true;
+  }
+  latencyStats::clock::time_point t0;
+  if (Latency) t0 = latencyStats::clock::now();
+  auto err = Sock->send(BatchRequest, strlen(BatchRequest), ZMQ_SNDMORE);
+  for (size_t i = 0; err >= 0 && i < n; ++i)
+    err = enc[i]->send(*Sock, i + 1 < n ? ZMQ_SNDMORE : 0);
+  if (err < 0) {
+    std::ostringstream os;
+    os << "Could not send command to [" << Server
+       << "] :" << zmq_strerror(-err);
+    lastErr = os.str();
+    return false;
+  }
+  if (Latency) sent(t0);
+  if (!receive()) return false;
+
+  // one parse per batch, whatever its size
+  std::string_view r = Reply.view();
+  Json             rj;
+  if (parseResult(r, rj) && rj.is_array() && rj.size() == n) {
+    lastErr.clear();
+    return true;
+  }
+  // an error message instead of the results: ActorMsgBatch is unknown
+  if (rj.is_string()) {
+    lastErr.clear();
+    return false;
+  }
+  lastErr = "Unexpected response:" + std::string(r);
+  return false;
+}
+
+bool simConsole::isResultString(std::string_view reply) {
+  size_t i  = 0;
+  auto   ws = [&]() {
+    while (i < reply.size() && (reply[i] == ' ' || reply[i] == '\t' ||
+                                reply[i] == '\n' || reply[i] == '\r'))
+      ++i;
+  };
+  for (std::string_view tok : {"{", "\"Result\"", ":", "\""}) {
+    ws();
+    if (reply.compare(i, tok.size(), tok) != 0) return false;
+    i += tok.size();
+  }
+  return true;
+}
+
 bool simConsole::listEndpoints(std::string tag, std::vector<std::string> &res) {
-  std::ostringstream os;
-  os << "{\n"
-     << "\"Type\" :  \"ListEndpoint\",\n"
-     << "\"Tag\" : \"" << tag << "\"\n"
-     << "}";
-  std::string r;
-  if (!submitRequest(os.str(), r)) return false;
-
-  auto rj = Json::parse(r);
-  if (rj.count("Result") || rj["Result"].is_array()) {
-    for (Json::iterator it = rj["Result"].begin(), ec = rj["Result"].end();
-         it != ec; ++it) {
-      res.push_back(*it);
-    }
+  std::string_view r;
+  if (!submitRequest(request("ListEndpoint", "Tag", tag), r)) return false;
+
+  if (parseList(r, res)) {
     lastErr.clear();
     return true;
   }
-  lastErr = "Unexpected response:" + r;
+  lastErr = "Unexpected response:" + std::string(r);
   return false;
 }
 bool simConsole::getActorMetadata(std::string actor, Json &res) {
-  std::ostringstream os;
-  os << "{\n"
-     << "\"Type\" :  \"GetActorMeta\",\n"
-     << "\"Endpoint\" : \"" << actor << "\"\n"
-     << "}";
-  std::string r;
-  if (!submitRequest(os.str(), r)) return false;
+  std::string_view r;
+  if (!submitRequest(request("GetActorMeta", "Endpoint", actor), r))
+    return false;
 
-  auto rj = Json::parse(r);
-  if (rj.count("Result")) {
-    res = rj["Result"];
+  if (parseResult(r, res)) {
     lastErr.clear();
     return true;
   }
-  lastErr = "Unexpected response:" + r;
+  lastErr = "Unexpected response:" + std::string(r);
   return false;
 }
 
 bool simConsole::submitRequest(std::vector<std::string> req, std::string &res) {
-  for (int i = 0; i < req.size(); ++i) {
-    int flags = 0;
-    if (i != req.size() - 1) flags = ZMQ_SNDMORE;
-    auto err = Sock->send(req[i].begin(), req[i].end(), flags);
+  std::string_view r;
+  if (!submitRequest(req, r)) return false;
+  res.assign(r.data(), r.size());
+  return true;
+}
+
+bool simConsole::submitRequest(const std::vector<std::string> &req,
+                               std::string_view                &res) {
+  if (!exchange(req.data(), req.size())) return false;
+  res = Reply.view();
+  return true;
+}
+
+bool simConsole::setHeartbeat(int ivl_ms, int timeout_ms) {
+#ifdef ZMQ_HEARTBEAT_IVL
+  int err = Sock->setsockopt(ZMQ_HEARTBEAT_IVL, &ivl_ms, sizeof(ivl_ms));
+  if (err >= 0)
+    err = Sock->setsockopt(ZMQ_HEARTBEAT_TIMEOUT, &timeout_ms,
+                           sizeof(timeout_ms));
+  if (err >= 0)
+    err = Sock->setsockopt(ZMQ_HEARTBEAT_TTL, &timeout_ms, sizeof(timeout_ms));
+  if (err >= 0) return true;
+  std::ostringstream os;
+  os << "Cannot set heartbeat: " << zmq_strerror(-err);
+  lastErr = os.str();
+#else
+  lastErr = "Heartbeats need libzmq 4.2 or later";
+#endif
+  return false;
+}
+
+bool simConsole::startMonitor(zmq::monitor_t &mon, const std::string &addr,
+                              int events) {
+  if (mon.init(*Sock, addr, events)) return true;
+  lastErr = std::string("Cannot monitor socket: ") + zmq_strerror(zmq_errno());
+  return false;
+}
+
+bool simConsole::trySend(std::vector<std::string> req) {
+  latencyStats::clock::time_point t0;
+  if (Latency) t0 = latencyStats::clock::now();
+  for (size_t i = 0; i < req.size(); ++i) {
+    int flags = ZMQ_DONTWAIT;
+    if (i != req.size() - 1) flags |= ZMQ_SNDMORE;
+    auto err = Sock->send(req[i].data(), req[i].size(), flags);
+    if (err == -EAGAIN && i == 0) {
+      lastErr.clear();
+      return false;
+    }
     if (err < 0) {
       std::ostringstream os;
       os << "Could not send command to [" << Server
-         << "] :" << zmq_strerror(err);
+         << "] :" << zmq_strerror(-err);
       lastErr = os.str();
       return false;
     }
   }
-  zmq::message_t msg;
-  auto           err = Sock->recv(&msg);
+  if (Latency) sent(t0);
+  lastErr.clear();
+  return true;
+}
+
+bool simConsole::tryRecv(std::string &res) {
+  std::string_view r;
+  if (!tryRecv(r)) return false;
+  res.assign(r.data(), r.size());
+  return true;
+}
+
+bool simConsole::tryRecv(std::string_view &res) {
+  auto err = Sock->recv(&Reply, ZMQ_DONTWAIT);
+  if (err == -EAGAIN) {
+    lastErr.clear();
+    return false;
+  }
   if (err < 0) {
     std::ostringstream os;
     os << "Could not receive response from [" << Server
-       << "] :" << zmq_strerror(err);
+       << "] :" << zmq_strerror(-err);
     lastErr = os.str();
     return false;
   }
+  if (Latency) replied();
   lastErr.clear();
-  res = std::string(msg.data<char>(), msg.size());
+  res = Reply.view();
   return true;
 }
 
 bool simConsole::submitRequest(std::string req, std::string &res) {
-  auto err = Sock->send(req.begin(), req.end());
-  if (err < 0) {
-    std::ostringstream os;
-    os << "Could not send command to [" << Server << "] :" << zmq_strerror(err);
-    lastErr = os.str();
-    return false;
+  std::string_view r;
+  if (!submitRequest(req, r)) return false;
+  res.assign(r.data(), r.size());
+  return true;
+}
+
+bool simConsole::submitRequest(const std::string &req, std::string_view &res) {
+  if (!exchange(&req, 1)) return false;
+  res = Reply.view();
+  return true;
+}
+
+bool simConsole::exchange(const std::string *req, size_t n) {
+  latencyStats::clock::time_point t0;
+  if (Latency) t0 = latencyStats::clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    auto err = Sock->send(req[i].data(), req[i].size(),
+                          i != n - 1 ? ZMQ_SNDMORE : 0);
+    if (err < 0) {
+      std::ostringstream os;
+      os << "Could not send command to [" << Server
+         << "] :" << zmq_strerror(-err);
+      lastErr = os.str();
+      return false;
+    }
   }
-  zmq::message_t msg;
-  err = Sock->recv(&msg);
+  if (Latency) sent(t0);
+  return receive();
+}
+
+bool simConsole::receive() {
+  // the previous reply is released by the receive
+  auto err = Sock->recv(&Reply);
   if (err < 0) {
     std::ostringstream os;
     os << "Could not receive response from [" << Server
-       << "] :" << zmq_strerror(err);
+       << "] :" << zmq_strerror(-err);
     lastErr = os.str();
     return false;
   }
+  if (Latency) replied();
   lastErr.clear();
-  res = std::string(msg.data<char>(), msg.size());
   return true;
 }
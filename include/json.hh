@@ -5,6 +5,14 @@ http://opensource.org/licenses/mit-license.php
 */
 
 #pragma once
+#include <algorithm>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
 #include <nlohmann/json.hpp>
 
 struct ciless {
@@ -26,5 +34,130 @@ struct ciless {
 template <typename K, typename V, typename C, typename A>
 using cimap = std::map<K, V, ciless, A>;
 
-// case insensitive json type
-using Json = nlohmann::basic_json<cimap>;
+// case insensitive map over a sorted vector. Same ordering and lookup
+// semantics as cimap, but objects are a single contiguous allocation and
+// lookups are binary searches over it, which suits the small objects of the
+// CommActor protocol. Keys are stored non-const so that elements move
+// cheaply; do not modify them through iterators. Like any vector, insert and
+// erase invalidate iterators.
+template <typename K, typename V, typename A>
+using ciflatvector = std::vector<
+    std::pair<K, V>,
+    typename std::allocator_traits<A>::template rebind_alloc<std::pair<K, V>>>;
+
+template <typename K, typename V, typename C = ciless,
+          typename A = std::allocator<std::pair<const K, V>>>
+struct ciflatmap : ciflatvector<K, V, A> {
+  using key_type       = K;
+  using mapped_type    = V;
+  using key_compare    = ciless;
+  using Container      = ciflatvector<K, V, A>;
+  using allocator_type = typename Container::allocator_type;
+  using iterator       = typename Container::iterator;
+  using const_iterator = typename Container::const_iterator;
+  using size_type      = typename Container::size_type;
+  using value_type     = typename Container::value_type;
+
+  ciflatmap() noexcept(noexcept(Container())) : Container{} {}
+  explicit ciflatmap(const allocator_type& alloc) : Container{alloc} {}
+  template <class It>
+  ciflatmap(It first, It last) {
+    insert(first, last);
+  }
+  ciflatmap(std::initializer_list<value_type> init) {
+    insert(init.begin(), init.end());
+  }
+
+  iterator find(const key_type& key) {
+    auto it = lower(this->begin(), this->end(), key);
+    return it != this->end() && !Less(key, it->first) ? it : this->end();
+  }
+  const_iterator find(const key_type& key) const {
+    auto it = lower(this->begin(), this->end(), key);
+    return it != this->end() && !Less(key, it->first) ? it : this->end();
+  }
+  size_type count(const key_type& key) const {
+    return find(key) != this->end() ? 1 : 0;
+  }
+
+  V& at(const key_type& key) {
+    auto it = find(key);
+    if (it == this->end()) throw std::out_of_range("key not found");
+    return it->second;
+  }
+  const V& at(const key_type& key) const {
+    auto it = find(key);
+    if (it == this->end()) throw std::out_of_range("key not found");
+    return it->second;
+  }
+  V& operator[](const key_type& key) {
+    auto it = lower(this->begin(), this->end(), key);
+    if (it != this->end() && !Less(key, it->first)) return it->second;
+    return Container::emplace(reserve(it), key, V{})->second;
+  }
+  const V& operator[](const key_type& key) const { return at(key); }
+
+  template <typename KeyArg, typename... Args>
+  std::pair<iterator, bool> emplace(KeyArg&& k, Args&&... args) {
+    key_type key(std::forward<KeyArg>(k));
+    auto     it = lower(this->begin(), this->end(), key);
+    if (it != this->end() && !Less(key, it->first)) return {it, false};
+    it = Container::emplace(
+        reserve(it), std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+        std::forward_as_tuple(std::forward<Args>(args)...));
+    return {it, true};
+  }
+  std::pair<iterator, bool> insert(const value_type& v) {
+    return emplace(v.first, v.second);
+  }
+  std::pair<iterator, bool> insert(value_type&& v) {
+    return emplace(std::move(v.first), std::move(v.second));
+  }
+  template <typename It>
+  void insert(It first, It last) {
+    for (; first != last; ++first) emplace(first->first, first->second);
+  }
+
+  size_type erase(const key_type& key) {
+    auto it = find(key);
+    if (it == this->end()) return 0;
+    Container::erase(it);
+    return 1;
+  }
+  iterator erase(const_iterator pos) { return Container::erase(pos); }
+  iterator erase(const_iterator first, const_iterator last) {
+    return Container::erase(first, last);
+  }
+
+private:
+  // objects of the protocol rarely have more keys than this; one allocation
+  // instead of growing 1, 2, 4, 8
+  static constexpr size_type InitialCapacity = 8;
+  ciless                     Less;
+
+  iterator reserve(iterator pos) {
+    if (this->capacity()) return pos;
+    Container::reserve(InitialCapacity);
+    return this->begin();
+  }
+
+  template <typename It>
+  It lower(It first, It last, const key_type& key) const {
+    return std::lower_bound(first, last, key,
+                            [this](const value_type& e, const key_type& k) {
+                              return Less(e.first, k);
+                            });
+  }
+};
+
+// case insensitive json types. JsonFlat trades the per-node allocations of
+// JsonTree for one vector per object.
+using JsonTree = nlohmann::basic_json<cimap>;
+using JsonFlat = nlohmann::basic_json<ciflatmap>;
+
+// CAGE_JSON_FLATMAP selects the container behind Json
+#ifdef CAGE_JSON_FLATMAP
+using Json = JsonFlat;
+#else
+using Json = JsonTree;
+#endif
@@ -0,0 +1,208 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Latency histogram with HDR (high dynamic range) bucketing: exact below
+// 128 ns, 64 buckets per power of two above, so every value is kept within
+// 1/64 of itself from 1 ns up to about 18 minutes (larger values are
+// clamped) in 18 kB. record() is a few relaxed atomic operations; any number
+// of threads may record while another one summarizes.
+class latencyHistogram {
+public:
+  struct summary {
+    uint64_t count = 0;
+    // [ns]
+    double   mean = 0, p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0;
+  };
+
+  void    record(uint64_t ns);
+  // q in [0, 100]; 0 without samples
+  double  percentile(double q) const;
+  summary summarize() const;
+  void    reset();
+
+private:
+  static constexpr unsigned SubBits = 7;
+  static constexpr uint64_t Half    = uint64_t(1) << (SubBits - 1);
+  static constexpr unsigned MaxBits = 40;
+  static constexpr size_t   Buckets = (MaxBits - SubBits + 2) * Half;
+
+  std::atomic<uint64_t> Counts[Buckets]{};
+  std::atomic<uint64_t> Total{0}, Sum{0}, Max{0};
+
+  static size_t   index(uint64_t v);
+  // middle of the values falling into bucket i
+  static double   value(size_t i);
+  static unsigned msb(uint64_t v) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, v);
+    return i;
+#else
+    return 63 - __builtin_clzll(v);
+#endif
+  }
+};
+
+// Per stage latency histograms shared by simSubscriber, simConsole,
+// simAsyncConsole and CageAPI; attach one with their setLatencyStats().
+// Nothing is timed while none is attached.
+class latencyStats {
+public:
+  using clock = std::chrono::steady_clock;
+  enum stage {
+    RECV,      // subscriber socket receive, all frames of a message
+    FILTER,    // target actor check of a received report
+    PARSE,     // report decoder, or json parser for unknown payloads
+    DECODE,    // report fields -> vehicleStatus
+    PIPELINE,  // received -> vehicleStatus ready
+    SKEW,      // wall clock - report Time, above the smallest seen so far
+    SEND,      // console request send
+    REPLY,     // console request sent -> reply received
+    STAGES
+  };
+  static const char *name(stage s);
+
+  void record(stage s, clock::time_point from, clock::time_point to) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(to - from);
+    Hist[s].record(ns.count() > 0 ? ns.count() : 0);
+  }
+  // a report with Time simClock [s] was received at wall clock time at. The
+  // smallest difference seen is taken as the transport delay of zero, so
+  // SKEW shows queueing and jitter as long as the simulator runs in real
+  // time; reset() after the simulated clock was restarted.
+  void recordSkew(double simClock, clock::time_point at);
+
+  const latencyHistogram &get(stage s) const { return Hist[s]; }
+  void                    reset();
+  // one line per stage with samples; times in microseconds
+  void                    dump(std::ostream &os) const;
+
+private:
+  latencyHistogram     Hist[STAGES];
+  std::atomic<int64_t> MinOffset{std::numeric_limits<int64_t>::max()};
+};
+
+// ----------------------------------------------------------------
+
+size_t latencyHistogram::index(uint64_t v) {
+  v = std::min(v, (uint64_t(1) << MaxBits) - 1);
+  if (v < 2 * Half) return static_cast<size_t>(v);
+  unsigned shift = msb(v) - SubBits + 1;
+  return static_cast<size_t>(shift * Half + (v >> shift));
+}
+
+double latencyHistogram::value(size_t i) {
+  if (i < 2 * Half) return static_cast<double>(i);
+  unsigned shift = static_cast<unsigned>(i / Half - 1);
+  uint64_t low   = (i - shift * Half) << shift;
+  return low + ((uint64_t(1) << shift) - 1) / 2.;
+}
+
+void latencyHistogram::record(uint64_t ns) {
+  Counts[index(ns)].fetch_add(1, std::memory_order_relaxed);
+  Total.fetch_add(1, std::memory_order_relaxed);
+  Sum.fetch_add(ns, std::memory_order_relaxed);
+  uint64_t m = Max.load(std::memory_order_relaxed);
+  while (ns > m && !Max.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+    continue;
+}
+
+double latencyHistogram::percentile(double q) const {
+  uint64_t total = 0;
+  for (const auto &c : Counts) total += c.load(std::memory_order_relaxed);
+  if (!total) return 0;
+  uint64_t rank = std::max<uint64_t>(
+      1, static_cast<uint64_t>(std::ceil(q / 100. * total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < Buckets; ++i) {
+    seen += Counts[i].load(std::memory_order_relaxed);
+    if (seen >= rank)
+      return std::min(value(i),
+                      static_cast<double>(Max.load(std::memory_order_relaxed)));
+  }
+  return static_cast<double>(Max.load(std::memory_order_relaxed));
+}
+
+latencyHistogram::summary latencyHistogram::summarize() const {
+  summary s;
+  s.count = Total.load(std::memory_order_relaxed);
+  if (!s.count) return s;
+  s.mean = static_cast<double>(Sum.load(std::memory_order_relaxed)) / s.count;
+  s.p50  = percentile(50);
+  s.p90  = percentile(90);
+  s.p99  = percentile(99);
+  s.p999 = percentile(99.9);
+  s.max  = static_cast<double>(Max.load(std::memory_order_relaxed));
+  return s;
+}
+
+void latencyHistogram::reset() {
+  for (auto &c : Counts) c.store(0, std::memory_order_relaxed);
+  Total.store(0, std::memory_order_relaxed);
+  Sum.store(0, std::memory_order_relaxed);
+  Max.store(0, std::memory_order_relaxed);
+}
+
+const char *latencyStats::name(stage s) {
+  static const char *names[STAGES] = {"recv",     "filter", "parse", "decode",
+                                      "pipeline", "skew",   "send",  "reply"};
+  return s < STAGES ? names[s] : "?";
+}
+
+void latencyStats::recordSkew(double simClock, clock::time_point at) {
+  int64_t offset =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          at.time_since_epoch())
+          .count() -
+      static_cast<int64_t>(simClock * 1e9);
+  int64_t m = MinOffset.load(std::memory_order_relaxed);
+  while (offset < m &&
+         !MinOffset.compare_exchange_weak(m, offset, std::memory_order_relaxed))
+    continue;
+  Hist[SKEW].record(offset > m ? offset - m : 0);
+}
+
+void latencyStats::reset() {
+  for (auto &h : Hist) h.reset();
+  MinOffset.store(std::numeric_limits<int64_t>::max(),
+                  std::memory_order_relaxed);
+}
+
+void latencyStats::dump(std::ostream &os) const {
+  auto flags = os.flags();
+  auto prec  = os.precision();
+  os << std::left << std::setw(10) << "stage" << std::right << std::setw(10)
+     << "count";
+  for (const char *c : {"mean", "p50", "p90", "p99", "p99.9", "max"})
+    os << std::setw(10) << c;
+  os << "  [us]\n" << std::fixed << std::setprecision(1);
+  for (int s = 0; s < STAGES; ++s) {
+    auto r = Hist[s].summarize();
+    if (!r.count) continue;
+    os << std::left << std::setw(10) << name(static_cast<stage>(s))
+       << std::right << std::setw(10) << r.count;
+    for (double v : {r.mean, r.p50, r.p90, r.p99, r.p999, r.max})
+      os << std::setw(10) << v / 1000.;
+    os << "\n";
+  }
+  os.flags(flags);
+  os.precision(prec);
+}
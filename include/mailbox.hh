@@ -0,0 +1,53 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Single-producer single-consumer mailbox which always holds the newest
+// value. Triple buffered: the writer and the reader each own one slot and
+// swap with the shared middle slot through a single atomic exchange, so
+// neither side ever blocks, spins or waits for the other.
+template <typename T>
+class latestMailbox {
+public:
+  // writer side
+  void publish(const T &v) {
+    Slots[Back].value = v;
+    Slots[Back].seq   = ++Written;
+    unsigned prev = Middle.exchange(Back | FRESH, std::memory_order_acq_rel);
+    Back          = prev & INDEX;
+  }
+
+  // reader side: copies the newest value into v and returns its sequence
+  // number (1, 2, ...). Returns 0 and leaves v untouched if nothing has been
+  // published yet.
+  uint64_t latest(T &v) {
+    if (Middle.load(std::memory_order_relaxed) & FRESH) {
+      unsigned prev = Middle.exchange(Front, std::memory_order_acq_rel);
+      Front         = prev & INDEX;
+    }
+    if (Slots[Front].seq == 0) return 0;
+    v = Slots[Front].value;
+    return Slots[Front].seq;
+  }
+
+  // reader side: true if a value newer than the last latest() is waiting
+  bool fresh() const { return Middle.load(std::memory_order_acquire) & FRESH; }
+
+private:
+  static constexpr unsigned INDEX = 0x3, FRESH = 0x4;
+  struct alignas(64) slot {
+    T        value{};
+    uint64_t seq = 0;
+  };
+  slot                              Slots[3];
+  alignas(64) std::atomic<unsigned> Middle{1};
+  alignas(64) unsigned              Back    = 0;  // writer only
+  uint64_t                          Written = 0;  // writer only
+  alignas(64) unsigned              Front   = 2;  // reader only
+};
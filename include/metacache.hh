@@ -0,0 +1,234 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#include <sys/locking.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+// Small key/value file for decoded metadata, so that restarts need not
+// wait for the console. Host byte order:
+//   header : "CAGEMETA", uint32 version, uint32 entry count
+//   entry  : uint32 key size, uint32 value size, key, value
+// save() writes a temporary file of its own and renames it over the old
+// one, so readers never see a partial file. update() holds a lock file
+// while reading, changing and writing, so processes (and threads) sharing
+// the file do not drop each other's entries.
+namespace cagemeta {
+constexpr char     Magic[8] = {'C', 'A', 'G', 'E', 'M', 'E', 'T', 'A'};
+constexpr uint32_t Version  = 1;
+
+// appends values to a byte string
+class writer {
+public:
+  explicit writer(std::string &out) : Out(out) {}
+  template <typename T>
+  void put(const T &v) {
+    static_assert(std::is_trivially_copyable<T>::value, "use str()");
+    Out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+  void str(const std::string &s) {
+    put(static_cast<uint32_t>(s.size()));
+    Out.append(s);
+  }
+
+private:
+  std::string &Out;
+};
+
+// reads values written by writer. ok() turns false on truncated input
+class reader {
+public:
+  reader(const char *data, size_t size) : P(data), End(data + size) {}
+  template <typename T>
+  bool get(T &v) {
+    static_assert(std::is_trivially_copyable<T>::value, "use str()");
+    if (!Ok || static_cast<size_t>(End - P) < sizeof(v)) return Ok = false;
+    memcpy(&v, P, sizeof(v));
+    P += sizeof(v);
+    return true;
+  }
+  bool str(std::string &s) {
+    uint32_t n = 0;
+    if (!get(n) || static_cast<size_t>(End - P) < n) return Ok = false;
+    s.assign(P, n);
+    P += n;
+    return true;
+  }
+  bool ok() const { return Ok; }
+  bool atEnd() const { return P == End; }
+
+private:
+  const char *P, *End;
+  bool        Ok = true;
+};
+}  // namespace cagemeta
+
+class metadataCache {
+public:
+  explicit metadataCache(std::string path) : Path(std::move(path)) {}
+
+  // read the file. a missing file is an empty cache
+  bool        load();
+  bool        save();
+  std::string getPath() const { return Path; }
+  std::string getLastError() { return lastErr; }
+
+  bool find(const std::string &key, std::string &value) const;
+  void store(const std::string &key, std::string value) {
+    Entries[key] = std::move(value);
+  }
+  // load, store and save under an exclusive lock on Path + ".lock"
+  bool update(const std::string &key, std::string value);
+
+protected:
+  std::string                        Path;
+  std::string                        lastErr;
+  std::map<std::string, std::string> Entries;
+
+  bool fail(const std::string &what);
+};
+
+// ----------------------------------------------------------------
+
+bool metadataCache::fail(const std::string &what) {
+  std::ostringstream os;
+  os << what << " " << Path << ": " << std::strerror(errno);
+  lastErr = os.str();
+  return false;
+}
+
+bool metadataCache::find(const std::string &key, std::string &value) const {
+  auto it = Entries.find(key);
+  if (it == Entries.end()) return false;
+  value = it->second;
+  return true;
+}
+
+bool metadataCache::load() {
+  Entries.clear();
+  FILE *f = std::fopen(Path.c_str(), "rb");
+  if (!f) {
+    if (errno == ENOENT) {
+      lastErr.clear();
+      return true;
+    }
+    return fail("Cannot open");
+  }
+  std::string data;
+  char        buf[4096];
+  size_t      n;
+  while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) data.append(buf, n);
+  std::fclose(f);
+
+  cagemeta::reader r(data.data(), data.size());
+  char             magic[8];
+  uint32_t         version = 0, count = 0;
+  if (!r.get(magic) || memcmp(magic, cagemeta::Magic, sizeof(magic)) ||
+      !r.get(version) || version != cagemeta::Version || !r.get(count)) {
+    lastErr = "Not a metadata cache (or other version): " + Path;
+    return false;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    std::string key, value;
+    if (!r.str(key) || !r.str(value)) break;
+    Entries[key] = std::move(value);
+  }
+  if (!r.ok()) {
+    Entries.clear();
+    lastErr = "Broken metadata cache: " + Path;
+    return false;
+  }
+  lastErr.clear();
+  return true;
+}
+
+bool metadataCache::save() {
+  std::string      data;
+  cagemeta::writer w(data);
+  w.put(cagemeta::Magic);
+  w.put(cagemeta::Version);
+  w.put(static_cast<uint32_t>(Entries.size()));
+  for (const auto &e : Entries) {
+    w.str(e.first);
+    w.str(e.second);
+  }
+
+  // unique per process and call: concurrent saves never share a file
+  static std::atomic<unsigned> seq{0};
+  std::ostringstream           name;
+#ifdef _WIN32
+  name << Path << ".tmp." << _getpid() << "." << ++seq;
+#else
+  name << Path << ".tmp." << getpid() << "." << ++seq;
+#endif
+  std::string tmp = name.str();
+  FILE       *f   = std::fopen(tmp.c_str(), "wb");
+  if (!f) return fail("Cannot create");
+  bool ok = std::fwrite(data.data(), 1, data.size(), f) == data.size();
+  ok      = std::fclose(f) == 0 && ok;
+  if (!ok) {
+    std::remove(tmp.c_str());
+    return fail("Cannot write");
+  }
+#ifdef _WIN32
+  std::remove(Path.c_str());  // rename does not replace on windows
+#endif
+  if (std::rename(tmp.c_str(), Path.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    return fail("Cannot replace");
+  }
+  lastErr.clear();
+  return true;
+}
+
+bool metadataCache::update(const std::string &key, std::string value) {
+  std::string lock = Path + ".lock";
+#ifdef _WIN32
+  int fd = _open(lock.c_str(), _O_CREAT | _O_RDWR, _S_IREAD | _S_IWRITE);
+  if (fd < 0) return fail("Cannot lock");
+  // retries for about 10 s
+  bool locked = _locking(fd, _LK_LOCK, 1) == 0;
+#else
+  // flock locks are per open file, so threads of a process exclude each
+  // other as well
+  int fd = ::open(lock.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+  if (fd < 0) return fail("Cannot lock");
+  bool locked = ::flock(fd, LOCK_EX) == 0;
+#endif
+  bool ok = locked;
+  if (!locked) {
+    fail("Cannot lock");
+  } else {
+    load();  // a broken file is replaced
+    store(key, std::move(value));
+    ok = save();
+  }
+#ifdef _WIN32
+  if (locked) _locking(fd, _LK_UNLCK, 1);
+  _close(fd);
+#else
+  ::close(fd);  // releases the lock
+#endif
+  return ok;
+}
@@ -0,0 +1,362 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.hh"
+#include "reportdecoder.hh"
+#include "wireformat.hh"
+#include "zmq_nt.hpp"
+
+// Stand-in for Cage CommActor, for tests and load measurements without the
+// simulator. Publishes Report messages for a set of vehicles on the reporter
+// socket (PUB) and answers ListEndpoint, GetActorMeta, Console, ActorMsg,
+// ActorMsgBatch and SetEncoding requests on the console socket (ROUTER, so
+// REQ and DEALER clients work). Vehicles follow the received VW/RPM
+// commands, JSON or binary, with ideal kinematics.
+//
+// Limitation: there is one report stream, so SetEncoding switches the
+// reports of every subscriber, not only those of the requesting client.
+// Clients of this library decode both formats; JSON-only clients (e.g. the
+// Python samples) must not share a mock with one that negotiates binary.
+class mockCommActor {
+public:
+  struct statistics {
+    std::atomic<uint64_t> reports{0};   // published report messages
+    std::atomic<uint64_t> requests{0};  // console requests answered
+    std::atomic<uint64_t> commands{0};  // ActorMsg requests
+  };
+
+  mockCommActor(zmq::context_t &ctx,
+                std::string     reporter = "tcp://127.0.0.1:54321",
+                std::string     console  = "tcp://127.0.0.1:54323");
+  ~mockCommActor() { stop(); }
+
+  // configuration; call before start()
+  void addVehicle(std::string name);
+  void setReportRate(double hz) { Rate = hz; }  // per vehicle
+  // send [name][report] instead of single frame reports
+  void setTopicFrames(bool on) { TopicFrames = on; }
+  // publish binary reports (wireformat.hh) from the start. A SetEncoding
+  // request switches this as well, for all subscribers
+  void setBinaryReports(bool on) { Binary = on; }
+  // publish these messages round-robin instead of synthesized reports
+  void setReplay(std::vector<std::string> payloads) {
+    Replay = std::move(payloads);
+  }
+
+  bool        start();
+  void        stop();
+  std::string getLastError() { return lastErr; }
+
+  const statistics &getStatistics() const { return Stats; }
+  // last command received for a vehicle (raw ActorMsg payload)
+  std::string lastCommand(const std::string &name);
+
+protected:
+  struct vehicle {
+    std::string name;
+    Json        meta;
+    double      v = 0, l = 0, w = 0;  // commanded [cm/s], [cm/s], [deg/s]
+    double      x = 0, y = 0, yaw = 0;  // right-handed [cm], [cm], [rad]
+    double      lrpm = 0, rrpm = 0;
+    std::string command;
+  };
+
+  zmq::context_t          &Ctx;
+  std::string              ReporterAddr, ConsoleAddr;
+  std::string              lastErr;
+  std::vector<vehicle>     Vehicles;
+  std::vector<std::string> Replay;
+  double                   Rate        = 100;
+  bool                     TopicFrames = false;
+  bool                     Binary      = false;  // report encoding
+  std::thread              Thread;
+  std::atomic<bool>        isTerminated{false};
+  std::mutex               Mutex;  // guards vehicle state against lastCommand
+  statistics               Stats;
+
+  void        run(zmq::socket_t &pub, zmq::socket_t &con);
+  void        publish(zmq::socket_t &pub, double simClock, double dt);
+  void        serve(zmq::socket_t &con);
+  // {"Result": ...} of a request
+  Json        handle(const Json &req, const std::string *payload);
+  void        command(vehicle &v, const std::string &payload);
+  vehicle    *find(const std::string &name);
+};
+
+// -----------------------------------------------
+
+mockCommActor::mockCommActor(zmq::context_t &ctx, std::string reporter,
+                             std::string console)
+    : Ctx(ctx), ReporterAddr(reporter), ConsoleAddr(console) {}
+
+void mockCommActor::addVehicle(std::string name) {
+  vehicle v;
+  v.name = name;
+  v.meta = Json::parse(
+      "{\"ReductionRatio\":15.0,\"TreadWidth\":38.0,"
+      "\"WheelPerimeterL\":62.793972,\"WheelPerimeterR\":62.793972}");
+  Vehicles.push_back(std::move(v));
+}
+
+bool mockCommActor::start() {
+  if (Thread.joinable()) return true;
+  // sockets are created here and handed over to the thread
+  auto pub = std::make_shared<zmq::socket_t>(Ctx, ZMQ_PUB);
+  auto con = std::make_shared<zmq::socket_t>(Ctx, ZMQ_ROUTER);
+  int  linger = 0;
+  pub->setsockopt(ZMQ_LINGER, linger);
+  con->setsockopt(ZMQ_LINGER, linger);
+  if (!pub->isValid() || !con->isValid() || pub->bind(ReporterAddr) != 0 ||
+      con->bind(ConsoleAddr) != 0) {
+    std::ostringstream os;
+    os << "Cannot bind mock sockets: " << zmq_strerror(zmq_errno());
+    lastErr = os.str();
+    return false;
+  }
+  isTerminated = false;
+  Thread       = std::thread([this, pub, con]() { run(*pub, *con); });
+  return true;
+}
+
+void mockCommActor::stop() {
+  if (!Thread.joinable()) return;
+  isTerminated = true;
+  Thread.join();
+}
+
+std::string mockCommActor::lastCommand(const std::string &name) {
+  std::lock_guard<std::mutex> lock(Mutex);
+  auto                        v = find(name);
+  return v ? v->command : std::string();
+}
+
+mockCommActor::vehicle *mockCommActor::find(const std::string &name) {
+  for (auto &v : Vehicles)
+    if (v.name == name) return &v;
+  return nullptr;
+}
+
+void mockCommActor::run(zmq::socket_t &pub, zmq::socket_t &con) {
+  using clock   = std::chrono::steady_clock;
+  auto   period = std::chrono::duration<double>(1. / Rate);
+  auto   start = clock::now(), next = start;
+  double simClock = 0;
+  while (!isTerminated.load(std::memory_order_relaxed)) {
+    auto now = clock::now();
+    if (now >= next) {
+      // catch up with the schedule if we fell behind
+      while (next <= now) {
+        simClock += period.count();
+        publish(pub, simClock, period.count());
+        next += std::chrono::duration_cast<clock::duration>(period);
+      }
+      continue;
+    }
+    long wait = static_cast<long>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(next - now)
+            .count());
+    zmq_pollitem_t item{static_cast<void *>(con), 0, ZMQ_POLLIN, 0};
+    if (zmq::poll(&item, 1, std::min(wait, 100L)) > 0) serve(con);
+  }
+}
+
+void mockCommActor::publish(zmq::socket_t &pub, double simClock, double dt) {
+  if (Replay.size()) {
+    for (size_t i = 0; i < Vehicles.size(); ++i) {
+      const auto &p = Replay[Stats.reports % Replay.size()];
+      pub.send(p.data(), p.size());
+      ++Stats.reports;
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> lock(Mutex);
+  char                        buf[1024];
+  for (auto &v : Vehicles) {
+    // integrate commanded motion in a right-handed frame
+    double wr = v.w * M_PI / 180.;
+    v.x += (v.v * std::cos(v.yaw) - v.l * std::sin(v.yaw)) * dt;
+    v.y += (v.v * std::sin(v.yaw) + v.l * std::cos(v.yaw)) * dt;
+    v.yaw += wr * dt;
+    // report in UE4 convention (left-handed, Y and rotation flipped)
+    int n;
+    if (Binary) {
+      reportFields f{};
+      double       lat[3] = {35, 41, 12.3456}, lon[3] = {139, 45, 56.789};
+      f.present = reportFields::NAME | reportFields::TIME | reportFields::DATA |
+                  reportFields::LRPM | reportFields::RRPM |
+                  reportFields::ACCEL | reportFields::ANGVEL |
+                  reportFields::POSE | reportFields::POSITION |
+                  reportFields::LAT | reportFields::LON;
+      f.name        = v.name;
+      f.time        = simClock;
+      f.lrpm        = v.lrpm;
+      f.rrpm        = v.rrpm;
+      f.accel[2]    = 980.665;
+      f.angvel[2]   = -v.w;
+      f.pose[2]     = std::sin(v.yaw / 2.);
+      f.pose[3]     = -std::cos(v.yaw / 2.);
+      f.position[0] = v.x;
+      f.position[1] = -v.y;
+      std::copy_n(lat, 3, f.lat);
+      std::copy_n(lon, 3, f.lon);
+      n = static_cast<int>(reportDecoder::encodeBinary(f, buf, sizeof(buf)));
+    } else {
+      n = snprintf(
+          buf, sizeof(buf),
+          "{\"Report\":{\"Name\":\"%s\",\"Time\":%.6f,\"Data\":{"
+          "\"LeftRpm\":%.6f,\"RightRpm\":%.6f,"
+          "\"Accel\":{\"X\":0.0,\"Y\":0.0,\"Z\":980.665},"
+          "\"AngVel\":{\"X\":0.0,\"Y\":0.0,\"Z\":%.6f},"
+          "\"Pose\":{\"X\":0.0,\"Y\":0.0,\"Z\":%.9f,\"W\":%.9f},"
+          "\"Position\":{\"X\":%.4f,\"Y\":%.4f,\"Z\":0.0},"
+          "\"lat\":{\"X\":35,\"Y\":41,\"Z\":12.3456},"
+          "\"lon\":{\"X\":139,\"Y\":45,\"Z\":56.789}}}}",
+          v.name.c_str(), simClock, v.lrpm, v.rrpm, -v.w,
+          std::sin(v.yaw / 2.), -std::cos(v.yaw / 2.), v.x, -v.y);
+    }
+    if (n <= 0 || n >= static_cast<int>(sizeof(buf))) continue;
+    if (TopicFrames) pub.send(v.name.data(), v.name.size(), ZMQ_SNDMORE);
+    pub.send(buf, n);
+    ++Stats.reports;
+  }
+}
+
+void mockCommActor::serve(zmq::socket_t &con) {
+  // [identity][envelope...][empty][request][payload]
+  for (;;) {
+    std::vector<zmq::message_t> frames;
+    frames.emplace_back();
+    if (con.recv(&frames.back(), ZMQ_DONTWAIT) < 0) return;
+    while (frames.back().more()) {
+      frames.emplace_back();
+      con.recv(&frames.back());
+    }
+    size_t body = 0;
+    while (body < frames.size() && frames[body].size()) ++body;
+    if (++body >= frames.size()) continue;  // no delimiter or no request
+
+    auto text = [&](size_t i) {
+      return std::string(frames[i].data<char>(), frames[i].size());
+    };
+    std::string reply;
+    try {
+      Json req = Json::parse(text(body));
+      if (req.value("Type", std::string()) == "ActorMsgBatch") {
+        // [envelope][command] pairs, one result each
+        Json results = Json::array();
+        for (size_t i = body + 1; i + 1 < frames.size(); i += 2) {
+          std::string payload = text(i + 1);
+          results.push_back(handle(Json::parse(text(i)), &payload)["Result"]);
+        }
+        reply = Json{{"Result", results}}.dump();
+      } else {
+        std::string payload;
+        if (body + 1 < frames.size()) payload = text(body + 1);
+        reply = handle(req, body + 1 < frames.size() ? &payload : nullptr)
+                    .dump();
+      }
+    } catch (const std::exception &e) {
+      reply = Json{{"Result", std::string("Error: ") + e.what()}}.dump();
+    }
+    for (size_t i = 0; i < body; ++i) con.send(frames[i], ZMQ_SNDMORE);
+    con.send(reply.data(), reply.size());
+    ++Stats.requests;
+  }
+}
+
+Json mockCommActor::handle(const Json &req, const std::string *payload) {
+  std::string type = req.value("Type", std::string());
+  Json        res;
+  if (type == "ListEndpoint") {
+    std::string tag = req.value("Tag", std::string());
+    res["Result"]   = Json::array();
+    if (tag == "Vehicle")
+      for (const auto &v : Vehicles) res["Result"].push_back(v.name);
+    if (tag == "GeoReference") res["Result"].push_back("GeoReference");
+  } else if (type == "GetActorMeta") {
+    std::string ep = req.value("Endpoint", std::string());
+    if (ep == "GeoReference") {
+      res["Result"] = Json::parse(
+          "{\"GeoLocation\":{\"latitude\":{\"x\":35,\"y\":41,\"z\":12.3456},"
+          "\"longitude\":{\"x\":139,\"y\":45,\"z\":56.789}},"
+          "\"Transform\":{\"translation\":{\"x\":0,\"y\":0,\"z\":0},"
+          "\"rotation\":{\"w\":1,\"x\":0,\"y\":0,\"z\":0}}}");
+    } else {
+      std::lock_guard<std::mutex> lock(Mutex);
+      auto                        v = find(ep);
+      res["Result"]                 = v ? v->meta : Json::object();
+    }
+  } else if (type == "SetEncoding") {
+    // one report stream: this changes the reports of all subscribers
+    std::string enc = req.value("Encoding", std::string());
+    if (enc == cagewire::Name || enc == "json") {
+      Binary        = enc != "json";
+      res["Result"] = enc;
+    } else {
+      res["Result"] = "Error: unknown encoding";
+    }
+  } else if (type == "Console") {
+    res["Result"] = "mock: " + req.value("Input", std::string());
+  } else if (type == "ActorMsg") {
+    std::lock_guard<std::mutex> lock(Mutex);
+    auto v = find(req.value("Endpoint", std::string()));
+    if (!v || !payload) {
+      res["Result"] = "Error: no such endpoint";
+    } else {
+      command(*v, *payload);
+      ++Stats.commands;
+      res["Result"] = "OK";
+    }
+  } else {
+    res["Result"] = "Error: unknown request type";
+  }
+  return res;
+}
+
+void mockCommActor::command(vehicle &v, const std::string &payload) {
+  v.command    = payload;
+  double ratio = v.meta["ReductionRatio"];
+  double pl = v.meta["WheelPerimeterL"], pr = v.meta["WheelPerimeterR"];
+  double tread = v.meta["TreadWidth"];
+  cagewire::command c;
+  if (!cagewire::decodeCommand(payload.data(), payload.size(), c)) {
+    Json j = Json::parse(payload);
+    if (j.value("CmdType", std::string()) == "RPM")
+      c = {cagewire::CMD_RPM, {j.value("L", 0.), j.value("R", 0.), 0}};
+    else
+      c = {cagewire::CMD_VW,
+           {j.value("V", 0.), j.value("L", 0.), j.value("W", 0.)}};
+  }
+  if (c.type == cagewire::CMD_RPM) {
+    v.lrpm = c.v[0];
+    v.rrpm = c.v[1];
+    // right wheel turns negative when moving forward
+    double vl = v.lrpm / 60. / ratio * pl, vr = -v.rrpm / 60. / ratio * pr;
+    v.v       = (vl + vr) / 2.;
+    v.l       = 0;
+    v.w       = (vr - vl) / tread * 180. / M_PI;
+    return;
+  }
+  v.v       = c.v[0];
+  v.l       = c.v[1];
+  v.w       = c.v[2];
+  double wr = v.w * M_PI / 180.;
+  v.lrpm    = (v.v - wr * tread / 2.) / pl * 60. * ratio;
+  v.rrpm    = -(v.v + wr * tread / 2.) / pr * 60. * ratio;
+}
@@ -0,0 +1,246 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "cageclient.hh"
+#include "mailbox.hh"
+#include "statusring.hh"
+
+// Dead reckoning from wheel speeds (and optionally the gyro) of the reports.
+// Differential drive kinematics from VehicleInfo; the lateral speed of
+// setFLW cannot be seen in the wheel speeds and is taken from
+// setLateralVelocity(). Speeds are integrated with the trapezoidal rule,
+// positions at the middle yaw of each step.
+//
+// Samples are processed in blocks over plain arrays, one pass per stage, so
+// that the compiler vectorizes the per-sample arithmetic (sin/cos too where
+// a vector math library is available, e.g. glibc with -O3 -ffast-math).
+// Only the running sums of yaw and position are sequential. The covariance
+// of (x, y, yaw) is propagated per block in closed form: the noise of every
+// step is carried to the end of its block by the block's own displacement.
+// No allocation after construction.
+class wheelOdometry {
+public:
+  struct pose {
+    double   simClock = 0;  // of the newest sample integrated
+    double   x = 0, y = 0;  // [m] in the frame given to reset()
+    double   yaw = 0;       // [rad] counter-clockwise, (-pi, pi]
+    double   v = 0, l = 0;  // forward, left speed [m/s]
+    double   w = 0;         // yaw rate [rad/s]
+    double   cov[3][3]{};   // of x, y, yaw
+    uint64_t samples = 0;   // number of samples integrated
+  };
+  // error model: variances grow with the distance travelled and turned
+  struct noise {
+    double perMetre     = 1e-3;  // of distance [m^2/m]
+    double yawPerRadian = 1e-3;  // of yaw per turn [rad^2/rad]
+    double yawPerMetre  = 1e-4;  // of yaw per distance [rad^2/m]
+  };
+  enum yawSource { YAW_WHEELS, YAW_GYRO };
+
+  explicit wheelOdometry(const CageAPI::vehicleInfo &info);
+
+  // start again from this pose with zero covariance. the next sample only
+  // sets the clock
+  void reset(double x = 0, double y = 0, double yaw = 0);
+  void setNoise(const noise &n) { Noise = n; }
+  // YAW_GYRO integrates the measured yaw rate (rz) instead of the wheel
+  // speed difference; robust to wheel slip
+  void setYawSource(yawSource s) { YawSource = s; }
+  // lateral speed [m/s] last given to setFLW
+  void setLateralVelocity(double l) { Lateral = l; }
+
+  void update(const CageAPI::vehicleStatus &vst);
+  // n samples in time order. rz may be nullptr with YAW_WHEELS
+  void update(const double *clock, const double *lrpm, const double *rrpm,
+              const double *rz, size_t n);
+  void update(const statusRing::window &w);
+  // integrate everything pushed to ring since the last catchUp(). false if
+  // samples were overwritten before they were read; the pose then skips
+  // the gap
+  bool catchUp(const statusRing &ring);
+
+  const pose &getPose() const { return Pose; }
+  // pose for one other thread, published after every update
+  uint64_t    latestPose(pose &p) { return Latest.latest(p); }
+
+private:
+  static constexpr size_t Block = 64;
+
+  double    KL, KR, Tread;  // rpm -> wheel speed [m/s], tread [m]
+  noise     Noise;
+  yawSource YawSource = YAW_WHEELS;
+  double    Lateral   = 0;
+
+  pose     Pose;
+  bool     Started = false;
+  double   PrevV = 0, PrevW = 0;  // speeds of the previous sample
+  uint64_t Next  = 0;             // ring sequence of catchUp()
+
+  latestMailbox<pose> Latest;
+
+  void integrate(const double *clock, const double *lrpm, const double *rrpm,
+                 const double *rz, size_t n);
+};
+
+// ----------------------------------------------------------------
+
+wheelOdometry::wheelOdometry(const CageAPI::vehicleInfo &info) {
+  // right wheel turns negative when moving forward
+  KL    = info.WheelPerimeterL / 60. / info.ReductionRatio;
+  KR    = -info.WheelPerimeterR / 60. / info.ReductionRatio;
+  Tread = info.TreadWidth;
+}
+
+void wheelOdometry::reset(double x, double y, double yaw) {
+  Pose     = pose();
+  Pose.x   = x;
+  Pose.y   = y;
+  Pose.yaw = std::remainder(yaw, 2 * M_PI);
+  Started  = false;
+}
+
+void wheelOdometry::update(const CageAPI::vehicleStatus &vst) {
+  update(&vst.simClock, &vst.lrpm, &vst.rrpm, &vst.rz, 1);
+}
+
+void wheelOdometry::update(const double *clock, const double *lrpm,
+                           const double *rrpm, const double *rz, size_t n) {
+  for (size_t i = 0; i < n; i += Block)
+    integrate(clock + i, lrpm + i, rrpm + i, rz ? rz + i : nullptr,
+              std::min(Block, n - i));
+  Latest.publish(Pose);
+}
+
+void wheelOdometry::update(const statusRing::window &w) {
+  using F = statusRing;
+  auto c  = w.first(F::CLOCK);
+  update(c.data, w.first(F::LRPM).data, w.first(F::RRPM).data,
+         w.first(F::RZ).data, c.size);
+  c = w.second(F::CLOCK);
+  if (c.size)
+    update(c.data, w.second(F::LRPM).data, w.second(F::RRPM).data,
+           w.second(F::RZ).data, c.size);
+}
+
+bool wheelOdometry::catchUp(const statusRing &ring) {
+  auto w = ring.since(Next);
+  update(w);
+  bool ok = w.begin() == Next && ring.intact(w);
+  Next    = w.end();
+  return ok;
+}
+
+void wheelOdometry::integrate(const double *clock, const double *lrpm,
+                              const double *rrpm, const double *rz, size_t n) {
+  if (!Started) {
+    // the first sample gives the clock and the speeds to start from
+    Pose.simClock = clock[0];
+    PrevV         = (lrpm[0] * KL + rrpm[0] * KR) * .5;
+    PrevW         = YawSource == YAW_GYRO && rz
+                        ? rz[0]
+                        : (rrpm[0] * KR - lrpm[0] * KL) / Tread;
+    Started       = true;
+    if (--n == 0) return;
+    ++clock, ++lrpm, ++rrpm;
+    if (rz) ++rz;
+  }
+  // [i + 1] is sample i, [0] the sample before the block
+  double v[Block + 1], w[Block + 1], t[Block + 1];
+  double ds[Block], dl[Block], dth[Block], mid[Block];
+  double c[Block], s[Block], dx[Block], dy[Block], px[Block], py[Block];
+
+  v[0] = PrevV;
+  w[0] = PrevW;
+  t[0] = Pose.simClock;
+  for (size_t i = 0; i < n; ++i) {
+    double vl = lrpm[i] * KL, vr = rrpm[i] * KR;
+    v[i + 1]  = (vl + vr) * .5;
+    w[i + 1]  = (vr - vl) / Tread;
+    t[i + 1]  = clock[i];
+  }
+  if (YawSource == YAW_GYRO && rz)
+    for (size_t i = 0; i < n; ++i) w[i + 1] = rz[i];
+
+  // trapezoidal steps. a clock going back (simulator restarted) is no step
+  for (size_t i = 0; i < n; ++i) {
+    double dt = std::max(0., t[i + 1] - t[i]);
+    ds[i]     = (v[i] + v[i + 1]) * .5 * dt;
+    dth[i]    = (w[i] + w[i + 1]) * .5 * dt;
+    dl[i]     = Lateral * dt;
+  }
+  double yaw = Pose.yaw;
+  for (size_t i = 0; i < n; ++i) {
+    mid[i] = yaw + dth[i] * .5;
+    yaw += dth[i];
+  }
+  for (size_t i = 0; i < n; ++i) {
+    c[i] = std::cos(mid[i]);
+    s[i] = std::sin(mid[i]);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    dx[i] = ds[i] * c[i] - dl[i] * s[i];
+    dy[i] = ds[i] * s[i] + dl[i] * c[i];
+  }
+  double X = 0, Y = 0;  // displacement over the block
+  for (size_t i = 0; i < n; ++i) {
+    X += dx[i];
+    Y += dy[i];
+    px[i] = X;
+    py[i] = Y;
+  }
+
+  // noise of step i: distance along (c, s), lateral along (-s, c) and yaw
+  // along d(pose)/d(yaw), which includes the displacement after the step
+  double qxx = 0, qxy = 0, qxt = 0, qyy = 0, qyt = 0, qtt = 0;
+  for (size_t i = 0; i < n; ++i) {
+    double as = std::fabs(ds[i]), al = std::fabs(dl[i]);
+    double qs = Noise.perMetre * as, ql = Noise.perMetre * al;
+    double qt = Noise.yawPerRadian * std::fabs(dth[i]) +
+                Noise.yawPerMetre * (as + al);
+    double j0 = -dy[i] * .5 - (Y - py[i]);
+    double j1 = dx[i] * .5 + (X - px[i]);
+    qxx += qs * c[i] * c[i] + ql * s[i] * s[i] + qt * j0 * j0;
+    qxy += (qs - ql) * c[i] * s[i] + qt * j0 * j1;
+    qyy += qs * s[i] * s[i] + ql * c[i] * c[i] + qt * j1 * j1;
+    qxt += qt * j0;
+    qyt += qt * j1;
+    qtt += qt;
+  }
+  // P = F P F^T + Q, F = d(pose after)/d(pose before) of the whole block
+  auto  &P  = Pose.cov;
+  double r0 = P[0][0] - Y * P[0][2], r1 = P[0][1] - Y * P[1][2];
+  double r2 = P[0][2] - Y * P[2][2];
+  double e1 = P[1][1] + X * P[1][2], e2 = P[1][2] + X * P[2][2];
+  double xx = r0 - Y * r2 + qxx;
+  double xy = r1 + X * r2 + qxy;
+  double xt = r2 + qxt;
+  double yy = e1 + X * e2 + qyy;
+  double yt = e2 + qyt;
+  double tt = P[2][2] + qtt;
+  P[0][0]   = xx;
+  P[0][1] = P[1][0] = xy;
+  P[0][2] = P[2][0] = xt;
+  P[1][1]           = yy;
+  P[1][2] = P[2][1] = yt;
+  P[2][2]           = tt;
+
+  Pose.x += X;
+  Pose.y += Y;
+  Pose.yaw      = std::remainder(yaw, 2 * M_PI);
+  Pose.v        = v[n];
+  Pose.w        = w[n];
+  Pose.l        = Lateral;
+  Pose.simClock = t[n];
+  Pose.samples += n;
+  PrevV = v[n];
+  PrevW = w[n];
+}
@@ -0,0 +1,452 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "zmq_nt.hpp"
+
+// Binary log of the report stream. Host byte order, all parts 8 byte aligned:
+//   header  : "CAGELOG\1", uint32 version, uint32 0, uint64 start (unix ns),
+//             uint64 0
+//   record  : uint64 t (ns since the first record), uint32 topic size,
+//             uint32 payload size, topic, payload, zero padding
+//   index   : uint64 file offset of every record
+//   trailer : uint64 index offset, uint64 record count, "CAGEIDX\1"
+// The index is written on close(); logs of crashed recorders have none and
+// are scanned on open instead.
+namespace cagelog {
+constexpr char     LogMagic[8]   = {'C', 'A', 'G', 'E', 'L', 'O', 'G', 1};
+constexpr char     IndexMagic[8] = {'C', 'A', 'G', 'E', 'I', 'D', 'X', 1};
+constexpr uint32_t Version       = 1;
+
+struct fileHeader {
+  char     magic[8];
+  uint32_t version, reserved;
+  uint64_t start, reserved2;
+};
+struct recordHeader {
+  uint64_t t;
+  uint32_t topicSize, size;
+};
+struct fileTrailer {
+  uint64_t index, count;
+  char     magic[8];
+};
+
+inline uint64_t padded(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+}  // namespace cagelog
+
+// Appends received messages to a log file.
+class reportRecorder {
+public:
+  ~reportRecorder() { close(); }
+  bool        open(const std::string &path);
+  // finish the file with the index. returns false on write errors.
+  bool        close();
+  bool        isOpen() const { return File != nullptr; }
+  std::string getLastError() { return lastErr; }
+
+  // record one message, time stamped now. topic may be empty.
+  bool   record(const void *data, size_t size, std::string_view topic = {});
+  size_t count() const { return Index.size(); }
+
+protected:
+  using clock = std::chrono::steady_clock;
+  std::FILE            *File = nullptr;
+  std::string           lastErr;
+  std::vector<uint64_t> Index;
+  uint64_t              Offset = 0;
+  clock::time_point     Start;
+  uint64_t              StartWall = 0;  // [ns] unix time of the first record
+
+  bool write(const void *data, size_t size);
+};
+
+// Read only view of a log file, memory mapped.
+class reportLog {
+public:
+  struct record {
+    uint64_t         t;  // [ns] since the first record
+    std::string_view topic;
+    std::string_view payload;
+  };
+
+  reportLog() = default;
+  reportLog(const reportLog &) = delete;
+  reportLog &operator=(const reportLog &) = delete;
+  ~reportLog() { close(); }
+  bool        open(const std::string &path);
+  void        close();
+  std::string getLastError() { return lastErr; }
+
+  size_t   size() const { return Count; }
+  record   at(size_t i) const;
+  uint64_t startTime() const;  // [ns] unix time of the first record
+  bool     indexed() const { return Scanned.empty(); }
+  // forget the mapping without unmapping it
+  void     abandon() { Base = nullptr; close(); }
+
+protected:
+  const char           *Base = nullptr;
+  size_t                Length = 0;
+  const uint64_t       *Index  = nullptr;
+  size_t                Count  = 0;
+  std::vector<uint64_t> Scanned;  // index built by scanning
+  std::string           lastErr;
+#ifdef _WIN32
+  HANDLE FileHandle = INVALID_HANDLE_VALUE, Mapping = NULL;
+#endif
+
+  bool map(const std::string &path);
+  void scan();
+};
+
+// Publishes the records of a log on a PUB socket with their original timing
+// scaled by speed (1: real time, 2: twice as fast, 0: as fast as possible).
+// Messages point into the mapping, nothing is copied.
+class reportReplayer {
+public:
+  reportReplayer(zmq::context_t &ctx,
+                 std::string     bindAddr = "tcp://127.0.0.1:54321");
+  ~reportReplayer();
+  bool        open(const std::string &path);
+  std::string getLastError() { return lastErr; }
+
+  void setSpeed(double speed) { Speed = speed; }
+  void setLoop(bool loop) { Loop = loop; }
+  // ZMQ_SNDHWM of the PUB socket; 0 is unlimited. set before open().
+  void setHighWaterMark(int hwm) { HighWaterMark = hwm; }
+  // publish until the end of the log (forever with loop) or until stop is
+  // set. returns the number of messages sent.
+  uint64_t play(const std::atomic<bool> *stop = nullptr);
+
+  const reportLog &log() const { return Log; }
+
+protected:
+  zmq::context_t                &Ctx;
+  std::string                    BindAddr;
+  std::string                    lastErr;
+  reportLog                      Log;
+  std::unique_ptr<zmq::socket_t> Sock;
+  double                         Speed         = 1;
+  bool                           Loop          = false;
+  int                            HighWaterMark = 1000;
+  std::atomic<uint64_t>          Outstanding{0};  // messages owned by zmq
+
+  static void release(void *, void *hint);
+  bool        send(std::string_view frame, int flags);
+};
+
+// -----------------------------------------------
+
+bool reportRecorder::open(const std::string &path) {
+  close();
+  File = std::fopen(path.c_str(), "wb");
+  if (!File) {
+    std::ostringstream os;
+    os << "Cannot open " << path << ": " << std::strerror(errno);
+    lastErr = os.str();
+    return false;
+  }
+  std::setvbuf(File, nullptr, _IOFBF, 1 << 20);
+  Index.clear();
+  Offset = 0;
+  cagelog::fileHeader h{};
+  memcpy(h.magic, cagelog::LogMagic, sizeof(h.magic));
+  h.version = cagelog::Version;
+  return write(&h, sizeof(h));
+}
+
+bool reportRecorder::write(const void *data, size_t size) {
+  if (size && std::fwrite(data, 1, size, File) != size) {
+    std::ostringstream os;
+    os << "Write error: " << std::strerror(errno);
+    lastErr = os.str();
+    return false;
+  }
+  Offset += size;
+  return true;
+}
+
+bool reportRecorder::record(const void *data, size_t size,
+                            std::string_view topic) {
+  if (!File) {
+    lastErr = "Recorder is not open";
+    return false;
+  }
+  static const char zero[8] = {};
+  cagelog::recordHeader r;
+  uint64_t              offset = Offset;
+  if (Index.empty()) {
+    Start     = clock::now();
+    StartWall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+  }
+  r.t = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                             Start)
+            .count();
+  r.topicSize  = static_cast<uint32_t>(topic.size());
+  r.size       = static_cast<uint32_t>(size);
+  uint64_t len = topic.size() + size;
+  if (!write(&r, sizeof(r)) || !write(topic.data(), topic.size()) ||
+      !write(data, size) || !write(zero, cagelog::padded(len) - len))
+    return false;
+  Index.push_back(offset);
+  return true;
+}
+
+bool reportRecorder::close() {
+  if (!File) return true;
+  cagelog::fileTrailer t;
+  t.index = Offset;
+  t.count = Index.size();
+  memcpy(t.magic, cagelog::IndexMagic, sizeof(t.magic));
+  bool ok = write(Index.data(), Index.size() * sizeof(uint64_t)) &&
+            write(&t, sizeof(t));
+  // the start time is known only after the first record
+  ok = ok &&
+       std::fseek(File, offsetof(cagelog::fileHeader, start), SEEK_SET) == 0 &&
+       write(&StartWall, sizeof(StartWall));
+  if (std::fclose(File) != 0 && ok) {
+    std::ostringstream os;
+    os << "Write error: " << std::strerror(errno);
+    lastErr = os.str();
+    ok      = false;
+  }
+  File = nullptr;
+  return ok;
+}
+
+// -----------------------------------------------
+
+bool reportLog::open(const std::string &path) {
+  close();
+  if (!map(path)) return false;
+  if (Length < sizeof(cagelog::fileHeader) ||
+      memcmp(Base, cagelog::LogMagic, sizeof(cagelog::LogMagic)) != 0) {
+    lastErr = path + " is not a cage log";
+    close();
+    return false;
+  }
+  // use the index if the trailer is intact, otherwise scan the records
+  cagelog::fileTrailer t;
+  if (Length >= sizeof(cagelog::fileHeader) + sizeof(t)) {
+    memcpy(&t, Base + Length - sizeof(t), sizeof(t));
+    if (memcmp(t.magic, cagelog::IndexMagic, sizeof(t.magic)) == 0 &&
+        t.index + t.count * sizeof(uint64_t) + sizeof(t) == Length) {
+      Index = reinterpret_cast<const uint64_t *>(Base + t.index);
+      Count = t.count;
+      return true;
+    }
+  }
+  scan();
+  return true;
+}
+
+void reportLog::scan() {
+  uint64_t off = sizeof(cagelog::fileHeader);
+  while (off + sizeof(cagelog::recordHeader) <= Length) {
+    cagelog::recordHeader r;
+    memcpy(&r, Base + off, sizeof(r));
+    uint64_t next = off + sizeof(r) +
+                    cagelog::padded(uint64_t(r.topicSize) + r.size);
+    if (next > Length) break;  // truncated record
+    Scanned.push_back(off);
+    off = next;
+  }
+  Index = Scanned.data();
+  Count = Scanned.size();
+}
+
+reportLog::record reportLog::at(size_t i) const {
+  const char           *p = Base + Index[i];
+  cagelog::recordHeader r;
+  memcpy(&r, p, sizeof(r));
+  p += sizeof(r);
+  return {r.t, std::string_view(p, r.topicSize),
+          std::string_view(p + r.topicSize, r.size)};
+}
+
+uint64_t reportLog::startTime() const {
+  cagelog::fileHeader h;
+  memcpy(&h, Base, sizeof(h));
+  return h.start;
+}
+
+#ifdef _WIN32
+bool reportLog::map(const std::string &path) {
+  FileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+  if (FileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(FileHandle, &size)) {
+    std::ostringstream os;
+    os << "Cannot open " << path << ": error " << GetLastError();
+    lastErr = os.str();
+    close();
+    return false;
+  }
+  Length = static_cast<size_t>(size.QuadPart);
+  if (Length == 0) return true;
+  Mapping = CreateFileMappingA(FileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (Mapping) Base = static_cast<const char *>(
+                   MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0));
+  if (!Base) {
+    std::ostringstream os;
+    os << "Cannot map " << path << ": error " << GetLastError();
+    lastErr = os.str();
+    close();
+    return false;
+  }
+  return true;
+}
+
+void reportLog::close() {
+  if (Base) UnmapViewOfFile(Base);
+  if (Mapping) CloseHandle(Mapping);
+  if (FileHandle != INVALID_HANDLE_VALUE) CloseHandle(FileHandle);
+  Mapping    = NULL;
+  FileHandle = INVALID_HANDLE_VALUE;
+  Base       = nullptr;
+  Length = Count = 0;
+  Index          = nullptr;
+  Scanned.clear();
+}
+#else
+bool reportLog::map(const std::string &path) {
+  int         fd = ::open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::ostringstream os;
+    os << "Cannot open " << path << ": " << std::strerror(errno);
+    lastErr = os.str();
+    if (fd >= 0) ::close(fd);
+    return false;
+  }
+  Length = static_cast<size_t>(st.st_size);
+  if (Length) {
+    void *p = mmap(nullptr, Length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      std::ostringstream os;
+      os << "Cannot map " << path << ": " << std::strerror(errno);
+      lastErr = os.str();
+      ::close(fd);
+      Length = 0;
+      return false;
+    }
+    // records are read front to back
+    madvise(p, Length, MADV_SEQUENTIAL);
+    Base = static_cast<const char *>(p);
+  }
+  ::close(fd);
+  return true;
+}
+
+void reportLog::close() {
+  if (Base) munmap(const_cast<char *>(Base), Length);
+  Base   = nullptr;
+  Length = Count = 0;
+  Index          = nullptr;
+  Scanned.clear();
+}
+#endif
+
+// -----------------------------------------------
+
+reportReplayer::reportReplayer(zmq::context_t &ctx, std::string bindAddr)
+    : Ctx(ctx), BindAddr(bindAddr) {}
+
+reportReplayer::~reportReplayer() {
+  if (Sock) {
+    int linger = 0;
+    Sock->setsockopt(ZMQ_LINGER, linger);
+    Sock->close();
+  }
+  // zmq may still hold messages pointing into the mapping; keep it mapped
+  // (and leak it) if they are not released in time
+  for (int i = 0; i < 1000 && Outstanding.load(); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  if (Outstanding.load()) Log.abandon();
+}
+
+bool reportReplayer::open(const std::string &path) {
+  if (!Log.open(path)) {
+    lastErr = Log.getLastError();
+    return false;
+  }
+  if (Sock) return true;
+  Sock.reset(new zmq::socket_t(Ctx, ZMQ_PUB));
+  Sock->setsockopt(ZMQ_SNDHWM, HighWaterMark);
+  if (!Sock->isValid() || Sock->bind(BindAddr) != 0) {
+    std::ostringstream os;
+    os << "Cannot bind " << BindAddr << ": " << zmq_strerror(zmq_errno());
+    lastErr = os.str();
+    Sock.reset();
+    return false;
+  }
+  return true;
+}
+
+void reportReplayer::release(void *, void *hint) {
+  static_cast<std::atomic<uint64_t> *>(hint)->fetch_sub(1);
+}
+
+bool reportReplayer::send(std::string_view frame, int flags) {
+  ++Outstanding;
+  zmq::message_t msg(const_cast<char *>(frame.data()), frame.size(), &release,
+                     &Outstanding);
+  return Sock->send(msg, flags) >= 0;
+}
+
+uint64_t reportReplayer::play(const std::atomic<bool> *stop) {
+  using clock   = std::chrono::steady_clock;
+  uint64_t sent = 0;
+  if (!Sock || Log.size() == 0) return 0;
+  do {
+    auto start = clock::now();
+    for (size_t i = 0; i < Log.size(); ++i) {
+      if (stop && stop->load(std::memory_order_relaxed)) return sent;
+      auto r = Log.at(i);
+      if (Speed > 0)
+        std::this_thread::sleep_until(
+            start + std::chrono::duration_cast<clock::duration>(
+                        std::chrono::duration<double, std::nano>(r.t / Speed)));
+      bool ok = r.topic.size() ? send(r.topic, ZMQ_SNDMORE) : true;
+      if (!ok || !send(r.payload, 0)) {
+        std::ostringstream os;
+        os << "Could not publish: " << zmq_strerror(zmq_errno());
+        lastErr = os.str();
+        return sent;
+      }
+      ++sent;
+    }
+  } while (Loop);
+  return sent;
+}
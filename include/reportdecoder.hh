@@ -0,0 +1,439 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "json.hh"
+#include "wireformat.hh"
+
+// Report fields as published by CommActor (UE4 units: cm, deg, left-handed)
+struct reportFields {
+  enum : uint32_t {
+    NAME     = 1 << 0,
+    TIME     = 1 << 1,
+    DATA     = 1 << 2,
+    LRPM     = 1 << 3,
+    RRPM     = 1 << 4,
+    ACCEL    = 1 << 5,
+    ANGVEL   = 1 << 6,
+    POSE     = 1 << 7,
+    POSITION = 1 << 8,
+    LAT      = 1 << 9,
+    LON      = 1 << 10,
+  };
+  uint32_t         present = 0;
+  std::string_view name;  // points into the decoded buffer
+  double           time;
+  double           lrpm, rrpm;
+  double           accel[3];     // X, Y, Z
+  double           angvel[3];    // X, Y, Z
+  double           pose[4];      // X, Y, Z, W
+  double           position[3];  // X, Y, Z
+  double           lat[3];       // deg, min, sec
+  double           lon[3];       // deg, min, sec
+
+  bool has(uint32_t bits) const { return (present & bits) == bits; }
+};
+
+// Schema specific decoder for {"Report":{"Name":..,"Time":..,"Data":{..}}}.
+// Scans the raw message bytes once without building a Json tree and without
+// heap allocation. Keys are matched case-insensitively like Json.
+// decode() returns false for anything outside the known schema (escaped
+// names, unexpected value types, truncated input, ...); callers are expected
+// to fall back to the Json path in that case. Binary reports (see
+// wireformat.hh) are recognized by their first byte and decoded here too;
+// there is no fallback for a broken one.
+class reportDecoder {
+public:
+  static bool decode(const char *data, size_t size, reportFields &f);
+  // locate Report.Name without decoding the rest of the message
+  static bool peekName(const char *data, size_t size, std::string_view &name);
+  // fill reportFields from a parsed Report object (Json fallback path)
+  static bool fromJson(const Json &report, reportFields &f);
+  // the Report object of f, for Json users of binary reports
+  static Json toJson(const reportFields &f);
+
+  static bool   isBinary(const char *data, size_t size) {
+    return cagewire::isBinary(data, size, cagewire::REPORT);
+  }
+  static bool   decodeBinary(const char *data, size_t size, reportFields &f);
+  // binary report of f into buf; bytes written, 0 if it does not fit
+  static size_t encodeBinary(const reportFields &f, char *buf, size_t size);
+
+private:
+  struct scanner {
+    const char *p, *end;
+
+    void ws() {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        ++p;
+    }
+    bool consume(char c) {
+      ws();
+      if (p >= end || *p != c) return false;
+      ++p;
+      return true;
+    }
+    bool peek(char c) {
+      ws();
+      return p < end && *p == c;
+    }
+    // raw string contents; fails on escape sequences
+    bool string(std::string_view &s);
+    bool skipString();
+    bool number(double &v);
+    bool skipValue(int depth = 0);
+    // iterate members of an object: f(key) must consume the value
+    template <typename F>
+    bool object(F f);
+    template <size_t N>
+    bool vector(double (&v)[N]);
+  };
+  static bool keyIs(std::string_view key, std::string_view name);
+  static bool data(scanner &s, reportFields &f);
+  static bool report(scanner &s, reportFields &f);
+  // fn(value) for the values of a binary report, in wire order
+  template <typename R, typename F>
+  static void values(R &f, F fn);
+};
+
+// -----------------------------------------------
+
+bool reportDecoder::keyIs(std::string_view key, std::string_view name) {
+  if (key.size() != name.size()) return false;
+  for (size_t i = 0; i < key.size(); ++i)
+    if (ciless::lc(key[i]) != ciless::lc(name[i])) return false;
+  return true;
+}
+
+bool reportDecoder::scanner::string(std::string_view &s) {
+  if (!consume('"')) return false;
+  const char *b = p;
+  while (p < end && *p != '"') {
+    if (*p == '\\') return false;
+    ++p;
+  }
+  if (p >= end) return false;
+  s = std::string_view(b, p - b);
+  ++p;
+  return true;
+}
+
+bool reportDecoder::scanner::skipString() {
+  if (!consume('"')) return false;
+  while (p < end && *p != '"') {
+    if (*p == '\\') ++p;
+    ++p;
+  }
+  if (p >= end) return false;
+  ++p;
+  return true;
+}
+
+bool reportDecoder::scanner::number(double &v) {
+  ws();
+  // exact fast path for short decimals (mantissa < 2^53, |exp| <= 22);
+  // anything else goes through from_chars.
+  static constexpr double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                     1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                     1e18, 1e19, 1e20, 1e21, 1e22};
+  const char *q   = p;
+  bool        neg = q < end && *q == '-';
+  if (neg) ++q;
+  uint64_t    m      = 0;
+  int         digits = 0, exp = 0;
+  for (; q < end && *q >= '0' && *q <= '9'; ++q, ++digits)
+    m = m * 10 + (*q - '0');
+  if (q < end && *q == '.')
+    for (++q; q < end && *q >= '0' && *q <= '9'; ++q, ++digits, --exp)
+      m = m * 10 + (*q - '0');
+  if (digits > 0 && digits <= 15 && exp >= -22 &&
+      (q == end || (*q != 'e' && *q != 'E'))) {
+    v = exp ? static_cast<double>(m) / pow10[-exp] : static_cast<double>(m);
+    if (neg) v = -v;
+    p = q;
+    return true;
+  }
+  auto r = std::from_chars(p, end, v);
+  if (r.ec != std::errc()) return false;
+  p = r.ptr;
+  return true;
+}
+
+bool reportDecoder::scanner::skipValue(int depth) {
+  if (depth > 32) return false;
+  ws();
+  if (p >= end) return false;
+  switch (*p) {
+    case '"':
+      return skipString();
+    case '{':
+      return object([&](std::string_view) { return skipValue(depth + 1); });
+    case '[':
+      ++p;
+      if (consume(']')) return true;
+      do {
+        if (!skipValue(depth + 1)) return false;
+      } while (consume(','));
+      return consume(']');
+    case 't':
+    case 'f':
+    case 'n':
+      while (p < end && *p >= 'a' && *p <= 'z') ++p;
+      return true;
+    default: {
+      const char *b = p;
+      while (p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' ||
+                         *p == '.' || *p == 'e' || *p == 'E'))
+        ++p;
+      return p != b;
+    }
+  }
+}
+
+template <typename F>
+bool reportDecoder::scanner::object(F f) {
+  if (!consume('{')) return false;
+  if (consume('}')) return true;
+  do {
+    std::string_view key;
+    if (peek('"') && !string(key)) {
+      // escaped key: never one of ours
+      key = std::string_view();
+      if (!skipString()) return false;
+    }
+    if (!consume(':')) return false;
+    if (!f(key)) return false;
+  } while (consume(','));
+  return consume('}');
+}
+
+template <size_t N>
+bool reportDecoder::scanner::vector(double (&v)[N]) {
+  static constexpr const char axes[] = "XYZW";
+  unsigned                    found  = 0;
+  bool                        ok     = object([&](std::string_view key) {
+    if (key.size() == 1) {
+      for (size_t i = 0; i < N; ++i) {
+        if (ciless::lc(key[0]) != ciless::lc(axes[i])) continue;
+        found |= 1u << i;
+        return number(v[i]);
+      }
+    }
+    return skipValue();
+  });
+  return ok && found == (1u << N) - 1;
+}
+
+bool reportDecoder::data(scanner &s, reportFields &f) {
+  return s.object([&](std::string_view key) {
+    if (keyIs(key, "LeftRpm")) {
+      f.present |= reportFields::LRPM;
+      return s.number(f.lrpm);
+    }
+    if (keyIs(key, "RightRpm")) {
+      f.present |= reportFields::RRPM;
+      return s.number(f.rrpm);
+    }
+    if (keyIs(key, "Accel")) {
+      f.present |= reportFields::ACCEL;
+      return s.vector(f.accel);
+    }
+    if (keyIs(key, "AngVel")) {
+      f.present |= reportFields::ANGVEL;
+      return s.vector(f.angvel);
+    }
+    if (keyIs(key, "Pose")) {
+      f.present |= reportFields::POSE;
+      return s.vector(f.pose);
+    }
+    if (keyIs(key, "Position")) {
+      f.present |= reportFields::POSITION;
+      return s.vector(f.position);
+    }
+    if (keyIs(key, "lat")) {
+      f.present |= reportFields::LAT;
+      return s.vector(f.lat);
+    }
+    if (keyIs(key, "lon")) {
+      f.present |= reportFields::LON;
+      return s.vector(f.lon);
+    }
+    return s.skipValue();
+  });
+}
+
+bool reportDecoder::report(scanner &s, reportFields &f) {
+  return s.object([&](std::string_view key) {
+    if (keyIs(key, "Name")) {
+      f.present |= reportFields::NAME;
+      return s.string(f.name);
+    }
+    if (keyIs(key, "Time")) {
+      f.present |= reportFields::TIME;
+      return s.number(f.time);
+    }
+    if (keyIs(key, "Data")) {
+      f.present |= reportFields::DATA;
+      return data(s, f);
+    }
+    return s.skipValue();
+  });
+}
+
+bool reportDecoder::decode(const char *data, size_t size, reportFields &f) {
+  if (isBinary(data, size)) return decodeBinary(data, size, f);
+  scanner s{data, data + size};
+  f.present = 0;
+  bool found = false;
+  bool ok    = s.object([&](std::string_view key) {
+    if (keyIs(key, "Report")) {
+      found = true;
+      return report(s, f);
+    }
+    return s.skipValue();
+  });
+  if (!ok || !found) return false;
+  s.ws();
+  // trailing NUL is tolerated for senders which count the terminator
+  return s.p == s.end || (s.p + 1 == s.end && *s.p == '\0');
+}
+
+bool reportDecoder::peekName(const char *data, size_t size,
+                             std::string_view &name) {
+  if (isBinary(data, size)) {
+    size_t n = size >= 4 ? cagewire::get(data + 2, 2) : 0;
+    if (size != cagewire::ReportHeader + n) return false;
+    name = std::string_view(data + cagewire::ReportHeader, n);
+    return true;
+  }
+  scanner s{data, data + size};
+  bool    found = false;
+  // returning false from the handlers stops the scan right after Name
+  s.object([&](std::string_view key) {
+    if (!keyIs(key, "Report")) return s.skipValue();
+    s.object([&](std::string_view key) {
+      if (!keyIs(key, "Name")) return s.skipValue();
+      found = s.string(name);
+      return false;
+    });
+    return false;
+  });
+  return found;
+}
+
+bool reportDecoder::fromJson(const Json &r, reportFields &f) {
+  f.present = 0;
+  if (!r.is_object()) return false;
+  auto number = [&](const Json &o, const char *key, uint32_t bit, double &v) {
+    auto it = o.find(key);
+    if (it == o.end()) return;
+    v = static_cast<double>(*it);
+    f.present |= bit;
+  };
+  auto vector = [&](const Json &o, const char *key, uint32_t bit, double *v,
+                    int n) {
+    auto it = o.find(key);
+    if (it == o.end()) return;
+    static const char *axes[] = {"X", "Y", "Z", "W"};
+    for (int i = 0; i < n; ++i) v[i] = static_cast<double>(it->at(axes[i]));
+    f.present |= bit;
+  };
+  auto name = r.find("Name");
+  if (name != r.end() && name->is_string()) {
+    f.name = name->get_ref<const std::string &>();
+    f.present |= reportFields::NAME;
+  }
+  number(r, "Time", reportFields::TIME, f.time);
+  auto d = r.find("Data");
+  if (d == r.end()) return true;
+  f.present |= reportFields::DATA;
+  number(*d, "LeftRpm", reportFields::LRPM, f.lrpm);
+  number(*d, "RightRpm", reportFields::RRPM, f.rrpm);
+  vector(*d, "Accel", reportFields::ACCEL, f.accel, 3);
+  vector(*d, "AngVel", reportFields::ANGVEL, f.angvel, 3);
+  vector(*d, "Pose", reportFields::POSE, f.pose, 4);
+  vector(*d, "Position", reportFields::POSITION, f.position, 3);
+  vector(*d, "lat", reportFields::LAT, f.lat, 3);
+  vector(*d, "lon", reportFields::LON, f.lon, 3);
+  return true;
+}
+
+template <typename R, typename F>
+void reportDecoder::values(R &f, F fn) {
+  fn(f.time);
+  fn(f.lrpm);
+  fn(f.rrpm);
+  for (auto &v : f.accel) fn(v);
+  for (auto &v : f.angvel) fn(v);
+  for (auto &v : f.pose) fn(v);
+  for (auto &v : f.position) fn(v);
+  for (auto &v : f.lat) fn(v);
+  for (auto &v : f.lon) fn(v);
+}
+
+bool reportDecoder::decodeBinary(const char *data, size_t size,
+                                 reportFields &f) {
+  f.present = 0;
+  if (size < cagewire::ReportHeader || !isBinary(data, size)) return false;
+  size_t n = cagewire::get(data + 2, 2);
+  if (size != cagewire::ReportHeader + n) return false;
+  const char *p = data + 8;
+  values(f, [&](double &v) {
+    v = cagewire::getDouble(p);
+    p += 8;
+  });
+  f.name    = std::string_view(p, n);
+  f.present = static_cast<uint32_t>(cagewire::get(data + 4, 4));
+  return true;
+}
+
+size_t reportDecoder::encodeBinary(const reportFields &f, char *buf,
+                                   size_t size) {
+  size_t n = f.has(reportFields::NAME) ? f.name.size() : 0;
+  if (n > 0xffff || size < cagewire::ReportHeader + n) return 0;
+  buf[0] = static_cast<char>(cagewire::Magic);
+  buf[1] = static_cast<char>(cagewire::REPORT);
+  cagewire::put(buf + 2, n, 2);
+  cagewire::put(buf + 4, f.present, 4);
+  char *p = buf + 8;
+  values(f, [&](const double &v) {
+    cagewire::putDouble(p, v);
+    p += 8;
+  });
+  if (n) memcpy(p, f.name.data(), n);
+  return cagewire::ReportHeader + n;
+}
+
+Json reportDecoder::toJson(const reportFields &f) {
+  Json r     = Json::object();
+  auto group = [&](Json &o, const char *key, uint32_t bit, const double *v,
+                   int n) {
+    if (!f.has(bit)) return;
+    static const char *axes[] = {"X", "Y", "Z", "W"};
+    Json              &g      = o[key];
+    for (int i = 0; i < n; ++i) g[axes[i]] = v[i];
+  };
+  if (f.has(reportFields::NAME)) r["Name"] = std::string(f.name);
+  if (f.has(reportFields::TIME)) r["Time"] = f.time;
+  if (!f.has(reportFields::DATA)) return r;
+  Json &d = r["Data"];
+  d       = Json::object();
+  if (f.has(reportFields::LRPM)) d["LeftRpm"] = f.lrpm;
+  if (f.has(reportFields::RRPM)) d["RightRpm"] = f.rrpm;
+  group(d, "Accel", reportFields::ACCEL, f.accel, 3);
+  group(d, "AngVel", reportFields::ANGVEL, f.angvel, 3);
+  group(d, "Pose", reportFields::POSE, f.pose, 4);
+  group(d, "Position", reportFields::POSITION, f.position, 3);
+  group(d, "lat", reportFields::LAT, f.lat, 3);
+  group(d, "lon", reportFields::LON, f.lon, 3);
+  return r;
+}
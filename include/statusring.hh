@@ -0,0 +1,180 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+// Fixed capacity history of decoded reports, stored as one contiguous array
+// per field (structure of arrays) so that filters and estimators can run
+// over recent samples without gathering them from structs.
+//
+// Single producer, any number of readers, no locks. The producer overwrites
+// the oldest sample when full. Readers take a window (zero copy views into
+// the arrays) and check intact() after using it: false means the producer
+// has lapped part of the window meanwhile and the values read may be mixed.
+class statusRing {
+public:
+  // columns, in the order of vehicleStatus
+  enum field {
+    CLOCK,
+    LRPM,
+    RRPM,
+    AX,  // accel [m/s^2]
+    AY,
+    AZ,
+    RX,  // rotational velocity [rad/s]
+    RY,
+    RZ,
+    OX,  // orientation
+    OY,
+    OZ,
+    OW,
+    WX,  // world position
+    WY,
+    WZ,
+    LATITUDE,
+    LONGITUDE,
+    FIELDS
+  };
+
+  // contiguous run of one column
+  struct span {
+    const double *data;
+    size_t        size;
+    const double &operator[](size_t i) const { return data[i]; }
+    const double *begin() const { return data; }
+    const double *end() const { return data + size; }
+  };
+
+  // samples [begin, end) by sequence number. A window wraps around the end
+  // of the ring at most once, so each column is two spans, oldest first.
+  class window {
+  public:
+    uint64_t begin() const { return Begin; }
+    uint64_t end() const { return End; }
+    size_t   size() const { return static_cast<size_t>(End - Begin); }
+    bool     empty() const { return End == Begin; }
+    span     first(field f) const { return {Base + f * Stride + Off, N1}; }
+    span     second(field f) const { return {Base + f * Stride, N2}; }
+    // i-th sample of the window, 0 the oldest
+    double   at(field f, size_t i) const {
+      return i < N1 ? Base[f * Stride + Off + i] : Base[f * Stride + i - N1];
+    }
+
+  private:
+    friend class statusRing;
+    const double *Base   = nullptr;
+    size_t        Stride = 0, Off = 0, N1 = 0, N2 = 0;
+    uint64_t      Begin  = 0, End = 0;
+  };
+
+  // capacity is rounded up to a power of two (at least 8)
+  explicit statusRing(size_t capacity);
+
+  // writer side. S is a CageAPI::vehicleStatus or anything with its fields
+  template <typename S>
+  void push(const S &vst);
+
+  size_t   capacity() const { return Capacity; }
+  // number of samples pushed so far; the sequence number of the next one
+  uint64_t head() const { return Head.load(std::memory_order_acquire); }
+
+  // newest n samples; fewer while the ring fills up. at most capacity()-1:
+  // the slot after them may be being written
+  window last(size_t n) const;
+  // samples from seq up to the newest, clipped to what is still held
+  window since(uint64_t seq) const;
+  // true if no sample of w has been overwritten up to now
+  bool   intact(const window &w) const;
+
+private:
+  struct alignedDelete {
+    void operator()(double *p) const {
+      ::operator delete[](p, std::align_val_t(Align));
+    }
+  };
+  // 64 bytes: every column starts on a cache line, aligned for any SIMD width
+  static constexpr size_t Align = 64;
+
+  size_t                                   Capacity, Mask;
+  std::unique_ptr<double[], alignedDelete> Data;
+  alignas(64) std::atomic<uint64_t>        Head{0};
+
+  double *column(field f) { return Data.get() + f * Capacity; }
+  window  make(uint64_t begin, uint64_t end) const;
+};
+
+// ----------------------------------------------------------------
+
+statusRing::statusRing(size_t capacity) {
+  Capacity = 8;
+  while (Capacity < capacity) Capacity <<= 1;
+  Mask = Capacity - 1;
+  Data.reset(static_cast<double *>(::operator new[](
+      FIELDS * Capacity * sizeof(double), std::align_val_t(Align))));
+  std::fill(Data.get(), Data.get() + FIELDS * Capacity, 0.);
+}
+
+template <typename S>
+void statusRing::push(const S &vst) {
+  uint64_t h = Head.load(std::memory_order_relaxed);
+  size_t   i = h & Mask;
+  column(CLOCK)[i]     = vst.simClock;
+  column(LRPM)[i]      = vst.lrpm;
+  column(RRPM)[i]      = vst.rrpm;
+  column(AX)[i]        = vst.ax;
+  column(AY)[i]        = vst.ay;
+  column(AZ)[i]        = vst.az;
+  column(RX)[i]        = vst.rx;
+  column(RY)[i]        = vst.ry;
+  column(RZ)[i]        = vst.rz;
+  column(OX)[i]        = vst.ox;
+  column(OY)[i]        = vst.oy;
+  column(OZ)[i]        = vst.oz;
+  column(OW)[i]        = vst.ow;
+  column(WX)[i]        = vst.wx;
+  column(WY)[i]        = vst.wy;
+  column(WZ)[i]        = vst.wz;
+  column(LATITUDE)[i]  = vst.latitude;
+  column(LONGITUDE)[i] = vst.longitude;
+  Head.store(h + 1, std::memory_order_release);
+}
+
+statusRing::window statusRing::make(uint64_t begin, uint64_t end) const {
+  window w;
+  w.Base   = Data.get();
+  w.Stride = Capacity;
+  w.Begin  = begin;
+  w.End    = end;
+  w.Off    = begin & Mask;
+  w.N1     = std::min<size_t>(end - begin, Capacity - w.Off);
+  w.N2     = (end - begin) - w.N1;
+  return w;
+}
+
+statusRing::window statusRing::last(size_t n) const {
+  uint64_t h = head();
+  n          = std::min<uint64_t>({n, h, Capacity - 1});
+  return make(h - n, h);
+}
+
+statusRing::window statusRing::since(uint64_t seq) const {
+  uint64_t h = head();
+  if (h > Capacity - 1) seq = std::max<uint64_t>(seq, h - (Capacity - 1));
+  return make(std::min(seq, h), h);
+}
+
+bool statusRing::intact(const window &w) const {
+  // order the reads of the window before the load of Head (seqlock style).
+  // the producer may be writing sample Head, which replaces Head-Capacity
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return Head.load(std::memory_order_relaxed) < w.Begin + Capacity;
+}
@@ -4,13 +4,26 @@ This software is released under the MIT License.
 http://opensource.org/licenses/mit-license.php
 */
 
+#pragma once
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#include <cmath>
+#else
+#include <poll.h>
+#include <sys/select.h>
+#endif
 
 #include "json.hh"
+#include "latency.hh"
+#include "reportdecoder.hh"
+#include "wireformat.hh"
 #include "zmq_nt.hpp"
 
 class simSubscriber {
@@ -23,14 +36,105 @@ public:
   bool        isValid() { return Sock && Sock->isValid(); }
   std::string getLastError() { return lastErr; }
   void        addTargetActor(std::string actor);
+  // make actor the only target
+  void        setTargetActor(std::string actor);
+  bool        isTargetActor(std::string_view actor) const;
+  // Topic mode: target actors become ZMQ_SUBSCRIBE prefixes, so libzmq drops
+  // other actors' reports. Publishers supporting it send two-frame messages
+  // [actor name][report json]. Single-frame reports of older publishers
+  // start with '{' (JSON) or cagewire::Magic (binary, wireformat.hh); both
+  // prefixes are subscribed, and those reports filtered on this side, while
+  // acceptLegacy is true.
+  void        setTopicMode(bool on, bool acceptLegacy = true);
   Json        recvOne();
+  // receive one message without parsing it. with ZMQ_DONTWAIT an empty
+  // queue returns false without setting an error
+  bool        recvRaw(zmq::message_t &msg, int flags = 0);
+  // recvRaw into a message kept by the subscriber. data views its payload
+  // and stays valid until the next recvView/recvOne; no copy, no allocation
+  // beyond what libzmq does for the message
+  bool        recvView(std::string_view &data, int flags = 0);
+  // topic frame of the last recvRaw'ed message; empty for single frame ones
+  std::string_view lastTopic() const {
+    return HasTopic ? std::string_view(TopicFrame.data<char>(),
+                                       TopicFrame.size())
+                    : std::string_view();
+  }
+  // drain the queue and keep only the newest report of the target actors.
+  // skipped is set to the number of older target reports thrown away.
+  bool        recvLatest(zmq::message_t &msg, int &skipped);
+  // keep only the last message in the socket queue (ZMQ_CONFLATE). must be
+  // set before connect(); not usable in topic mode (multipart messages).
+  // Also note that the kept message may come from a non-target actor.
+  bool        setConflate(bool on);
+  // ZMTP heartbeats (libzmq 4.2+): the connection is dropped and retried
+  // when the peer is silent for timeout_ms. must be set before connect()
+  bool        setHeartbeat(int ivl_ms, int timeout_ms);
+  // report connection events of the socket to mon (see CageAPI
+  // supervision). call before connect() to see the first connection
+  bool        startMonitor(zmq::monitor_t &mon, const std::string &addr,
+                           int events = ZMQ_EVENT_CONNECTED |
+                                        ZMQ_EVENT_DISCONNECTED);
+  // parse a received message and return its Report object if it comes from
+  // one of the target actors. binary reports are converted
+  Json        parseReport(const char *data, size_t size);
+  // wait for a message. timeout_ms < 0 waits forever
   bool        waitFor(int timeout_ms);
+  // wait for a message until deadline, with sub-millisecond precision where
+  // the platform allows (zmq_poll itself only has millisecond resolution)
+  bool        waitUntil(std::chrono::steady_clock::time_point deadline);
+
+  // Readiness for external event loops. getFd() (ZMQ_FD) is edge triggered
+  // and only tells that getEvents() (ZMQ_EVENTS) may have changed: when it
+  // fires, call tryRecv() until it returns false, and check getEvents()
+  // again after any other operation on the socket before going back to
+  // wait on the fd.
+  zmq::fd_t   getFd() const { return Sock->getsockopt<zmq::fd_t>(ZMQ_FD); }
+  uint32_t    getEvents() const {
+    return Sock->getsockopt<uint32_t>(ZMQ_EVENTS);
+  }
+  // recvRaw without blocking. false without an error set when the queue is
+  // empty
+  bool        tryRecv(zmq::message_t &msg) {
+    return recvRaw(msg, ZMQ_DONTWAIT);
+  }
+  // for zmq::poller_t together with other sockets; receive with recvRaw
+  zmq::socket_t &getSocket() { return *Sock; }
+
+  struct statistics {
+    uint64_t received = 0;  // messages taken from the socket
+    uint64_t dropped  = 0;  // reports from non-target actors
+    uint64_t skipped  = 0;  // superseded by newer reports in recvLatest
+  };
+  // returns false for reports from non-target actors and counts them as
+  // dropped. Only the topic frame of the last received message or
+  // Report.Name is looked at; the payload is not parsed.
+  bool              filterReport(const char *data, size_t size);
+  const statistics &getStatistics() const { return Stats; }
+  void              resetStatistics() { Stats = statistics(); }
+
+  // time receive (RECV) and parseReport (PARSE) into stats; nullptr stops.
+  // stats must outlive the subscriber or be detached first
+  void setLatencyStats(latencyStats *stats) { Latency = stats; }
+  // when the last recvRaw'ed message was received; set only while latency
+  // stats are attached
+  latencyStats::clock::time_point lastRecvTime() const { return RecvTime; }
 
 protected:
-  std::unique_ptr<zmq::socket_t> Sock;
-  std::string                    Server;
-  std::string                    lastErr;
-  std::set<std::string>          Actors;
+  std::unique_ptr<zmq::socket_t>     Sock;
+  std::string                        Server;
+  std::string                        lastErr;
+  std::set<std::string, std::less<>> Actors;
+  statistics                         Stats;
+  bool                               TopicMode = false, AcceptLegacy = true;
+  std::set<std::string>              Topics;  // current subscriptions
+  zmq::message_t                     TopicFrame;
+  bool                               HasTopic = false;
+  latencyStats                      *Latency  = nullptr;
+  latencyStats::clock::time_point    RecvTime;
+  zmq::message_t                     Msg;  // of recvView
+
+  void syncTopics();
 };
 
 // -----------------------------------------------
@@ -51,27 +155,195 @@ bool simSubscriber::connect() {
     return false;
   }
   lastErr.clear();
-  Sock->setsockopt(ZMQ_SUBSCRIBE, nullptr, 0);
+  syncTopics();
   return true;
 }
 
 void simSubscriber::close() { if(!Sock) return; Sock->close();Sock.release(); }
 
-void simSubscriber::addTargetActor(std::string actor) { Actors.insert(actor); }
+void simSubscriber::addTargetActor(std::string actor) {
+  Actors.insert(actor);
+  if (TopicMode) syncTopics();
+}
 
-Json simSubscriber::recvOne() {
-  zmq::message_t msg;
-  auto           err = Sock->recv(&msg);
+void simSubscriber::setTargetActor(std::string actor) {
+  Actors.clear();
+  Actors.insert(actor);
+  if (TopicMode) syncTopics();
+}
+
+void simSubscriber::setTopicMode(bool on, bool acceptLegacy) {
+  TopicMode    = on;
+  AcceptLegacy = acceptLegacy;
+  if (!Topics.empty()) syncTopics();
+}
+
+void simSubscriber::syncTopics() {
+  std::set<std::string> want;
+  if (!TopicMode || Actors.empty()) {
+    want.insert("");
+  } else {
+    want.insert(Actors.begin(), Actors.end());
+    if (AcceptLegacy) {
+      want.insert("{");
+      want.insert(std::string(1, static_cast<char>(cagewire::Magic)));
+    }
+  }
+  // subscribe first so that no report is lost while switching
+  for (const auto &t : want)
+    if (!Topics.count(t)) Sock->setsockopt(ZMQ_SUBSCRIBE, t.data(), t.size());
+  for (const auto &t : Topics)
+    if (!want.count(t)) Sock->setsockopt(ZMQ_UNSUBSCRIBE, t.data(), t.size());
+  Topics.swap(want);
+}
+
+bool simSubscriber::isTargetActor(std::string_view actor) const {
+  return Actors.empty() || Actors.find(actor) != Actors.end();
+}
+
+bool simSubscriber::setConflate(bool on) {
+  if (on && TopicMode) {
+    lastErr = "ZMQ_CONFLATE cannot be used with topic mode";
+    return false;
+  }
+  int v   = on ? 1 : 0;
+  int err = Sock->setsockopt(ZMQ_CONFLATE, &v, sizeof(v));
   if (err < 0) {
     std::ostringstream os;
-    os << " Possible reason: " << zmq_strerror(err) << std::endl;
+    os << "Cannot set ZMQ_CONFLATE: " << zmq_strerror(-err);
     lastErr = os.str();
-    return Json();
+    return false;
+  }
+  return true;
+}
+
+bool simSubscriber::setHeartbeat(int ivl_ms, int timeout_ms) {
+#ifdef ZMQ_HEARTBEAT_IVL
+  int err = Sock->setsockopt(ZMQ_HEARTBEAT_IVL, &ivl_ms, sizeof(ivl_ms));
+  if (err >= 0)
+    err = Sock->setsockopt(ZMQ_HEARTBEAT_TIMEOUT, &timeout_ms,
+                           sizeof(timeout_ms));
+  if (err >= 0)
+    err = Sock->setsockopt(ZMQ_HEARTBEAT_TTL, &timeout_ms, sizeof(timeout_ms));
+  if (err >= 0) return true;
+  std::ostringstream os;
+  os << "Cannot set heartbeat: " << zmq_strerror(-err);
+  lastErr = os.str();
+#else
+  lastErr = "Heartbeats need libzmq 4.2 or later";
+#endif
+  return false;
+}
+
+bool simSubscriber::startMonitor(zmq::monitor_t &mon, const std::string &addr,
+                                 int events) {
+  if (mon.init(*Sock, addr, events)) return true;
+  lastErr = std::string("Cannot monitor socket: ") + zmq_strerror(zmq_errno());
+  return false;
+}
+
+bool simSubscriber::recvRaw(zmq::message_t &msg, int flags) {
+  latencyStats::clock::time_point t0;
+  if (Latency) t0 = latencyStats::clock::now();
+  HasTopic = false;
+  auto err = Sock->recv(&msg, flags);
+  if (err == -EAGAIN && (flags & ZMQ_DONTWAIT)) {
+    lastErr.clear();
+    return false;
+  }
+  if (err >= 0 && msg.more()) {
+    // [topic][report]: keep the topic frame for filterReport
+    std::swap(TopicFrame, msg);
+    HasTopic = true;
+    err      = Sock->recv(&msg);
+    if (err >= 0 && msg.more()) {
+      // ignore extra frames of unknown envelopes
+      zmq::message_t extra;
+      while (Sock->recv(&extra) >= 0 && extra.more()) continue;
+    }
+  }
+  if (err < 0) {
+    std::ostringstream os;
+    os << " Possible reason: " << zmq_strerror(-err) << std::endl;
+    lastErr = os.str();
+    return false;
   }
   lastErr.clear();
-  std::string res(msg.data<char>(), msg.size());
+  ++Stats.received;
+  if (Latency) {
+    RecvTime = latencyStats::clock::now();
+    Latency->record(latencyStats::RECV, t0, RecvTime);
+  }
+  return true;
+}
+
+bool simSubscriber::filterReport(const char *data, size_t size) {
+  if (Actors.empty()) return true;
+  std::string_view name;
+  if (HasTopic) {
+    name = std::string_view(TopicFrame.data<char>(), TopicFrame.size());
+    if (Actors.find(name) != Actors.end()) return true;
+    ++Stats.dropped;
+    return false;
+  }
+  // undecidable here (escaped name etc.): leave it to the parser
+  if (!reportDecoder::peekName(data, size, name)) return true;
+  if (Actors.find(name) != Actors.end()) return true;
+  ++Stats.dropped;
+  return false;
+}
+
+bool simSubscriber::recvLatest(zmq::message_t &msg, int &skipped) {
+  zmq::message_t next;
+  bool           found = false;
+  int            flags = 0;
+  skipped              = 0;
+  // only the topic/name is looked at for reports which get superseded
+  while (recvRaw(next, flags)) {
+    flags = ZMQ_DONTWAIT;
+    if (!filterReport(next.data<char>(), next.size())) continue;
+    if (found) ++skipped;
+    std::swap(msg, next);
+    found = true;
+  }
+  Stats.skipped += skipped;
+  return found;
+}
+
+bool simSubscriber::recvView(std::string_view &data, int flags) {
+  if (!recvRaw(Msg, flags)) return false;
+  data = Msg.view();
+  return true;
+}
+
+Json simSubscriber::recvOne() {
+  std::string_view data;
+  if (!recvView(data)) return Json();
+  if (!filterReport(data.data(), data.size())) return Json();
+  return parseReport(data.data(), data.size());
+}
+
+Json simSubscriber::parseReport(const char *data, size_t size) {
+  latencyStats::clock::time_point t0;
+  if (Latency) t0 = latencyStats::clock::now();
+  if (reportDecoder::isBinary(data, size)) {
+    reportFields f;
+    if (!reportDecoder::decodeBinary(data, size, f)) {
+      lastErr = "Broken binary report received";
+      return Json();
+    }
+    if (Latency)
+      Latency->record(latencyStats::PARSE, t0, latencyStats::clock::now());
+    if (!isTargetActor(f.name)) {
+      ++Stats.dropped;
+      return Json();
+    }
+    return reportDecoder::toJson(f);
+  }
   // 受信JSONをパース
-  Json j = Json::parse(res);
+  Json j = Json::parse(data, data + size);
+  if (Latency)
+    Latency->record(latencyStats::PARSE, t0, latencyStats::clock::now());
 
   if (j.find("Report") == j.end()) {
     std::ostringstream os;
@@ -89,18 +361,15 @@ Json simSubscriber::recvOne() {
 
   std::string name = j2["Name"];
 
-  if (Actors.size()) {
-    decltype(Actors)::iterator it = Actors.find(name);
-    if (it == Actors.end()) return Json();
+  if (!isTargetActor(name)) {
+    ++Stats.dropped;
+    return Json();
   }
   return j2;
 }
 bool simSubscriber::waitFor(int timeout_ms) {
   uint32_t optval = Sock->getsockopt<uint32_t>(ZMQ_EVENTS);
-  if (optval & ZMQ_POLLIN) {
-    std::cerr << "waitFor: ZMQ_POLLIN success:" << optval << std::endl;
-    return true;
-  }
+  if (optval & ZMQ_POLLIN) return true;
 
   zmq_pollitem_t pollitem;
   pollitem.socket = static_cast<void *>(*Sock);
@@ -109,3 +378,43 @@ bool simSubscriber::waitFor(int timeout_ms) {
     return true;
   return false;
 }
+
+bool simSubscriber::waitUntil(std::chrono::steady_clock::time_point deadline) {
+  using clock = std::chrono::steady_clock;
+#ifdef _WIN32
+  // zmq_poll granularity: round up to whole milliseconds
+  for (;;) {
+    double left = std::chrono::duration<double, std::milli>(deadline -
+                                                            clock::now())
+                      .count();
+    if (left <= 0)
+      return Sock->getsockopt<uint32_t>(ZMQ_EVENTS) & ZMQ_POLLIN;
+    if (waitFor(static_cast<int>(std::ceil(left)))) return true;
+  }
+#else
+  // ZMQ_FD becomes readable (edge triggered) when ZMQ_EVENTS may have
+  // changed. Wait on it with a nanosecond timeout and recheck the events
+  // every time it fires.
+  int fd = getFd();
+  for (;;) {
+    if (Sock->getsockopt<uint32_t>(ZMQ_EVENTS) & ZMQ_POLLIN) return true;
+    auto left = deadline - clock::now();
+    if (left <= clock::duration::zero()) return false;
+    auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+    struct timespec ts;
+    ts.tv_sec  = static_cast<time_t>(ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000);
+#ifdef __linux__
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int           rc  = ppoll(&pfd, 1, &ts, nullptr);
+#else
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    int rc = pselect(fd + 1, &set, nullptr, nullptr, &ts, nullptr);
+#endif
+    if (rc < 0 && errno != EINTR) return false;
+  }
+#endif
+}
@@ -0,0 +1,85 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Binary encoding of reports and commands ("cagebin1"), an alternative to
+// JSON that the client asks for with the console request
+//   {"Type": "SetEncoding", "Encoding": "cagebin1"}
+// and the console accepts by answering {"Result": "cagebin1"} ("json"
+// switches back). Messages start with Magic, which never starts JSON, so
+// decoders pick the format per message and JSON keeps working throughout.
+// The setting is global to the console, not to the connection that sent
+// it: reports go out in it to every subscriber, and binary commands are
+// accepted on every console connection. CageAPI negotiates on its
+// handshake socket and sends commands on another one.
+// Little endian, values in the units of the JSON messages:
+//   report  : u8 Magic, u8 REPORT, u16 name size, u32 reportFields present
+//             bits, 22 f64 (Time, LeftRpm, RightRpm, Accel XYZ, AngVel XYZ,
+//             Pose XYZW, Position XYZ, lat XYZ, lon XYZ), name
+//   command : u8 Magic, u8 COMMAND, u8 command type, u8 0, 3 f64
+//             (RPM: L, R, 0  VW: V [cm/s], L [cm/s], W [deg/s])
+namespace cagewire {
+constexpr uint8_t Magic = 0xCB;
+constexpr char    Name[] = "cagebin1";
+enum kind : uint8_t { REPORT = 1, COMMAND = 2 };
+enum commandType : uint8_t { CMD_RPM = 0, CMD_VW = 1 };
+
+constexpr size_t ReportValues = 22;
+constexpr size_t ReportHeader = 8 + 8 * ReportValues;
+constexpr size_t CommandSize  = 4 + 8 * 3;
+
+inline bool isBinary(const char *data, size_t size, kind k) {
+  return size >= 2 && static_cast<uint8_t>(data[0]) == Magic &&
+         static_cast<uint8_t>(data[1]) == k;
+}
+
+// byte order independent; plain loads and stores on little endian hosts
+inline void put(char *p, uint64_t v, size_t n) {
+  for (size_t i = 0; i < n; ++i) p[i] = static_cast<char>(v >> 8 * i);
+}
+inline uint64_t get(const char *p, size_t n) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < n; ++i)
+    v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << 8 * i;
+  return v;
+}
+inline void putDouble(char *p, double v) {
+  uint64_t u;
+  memcpy(&u, &v, sizeof(u));
+  put(p, u, 8);
+}
+inline double getDouble(const char *p) {
+  uint64_t u = get(p, 8);
+  double   v;
+  memcpy(&v, &u, sizeof(v));
+  return v;
+}
+
+struct command {
+  uint8_t type;
+  double  v[3];
+};
+
+inline size_t encodeCommand(const command &c, char *buf) {
+  buf[0] = static_cast<char>(Magic);
+  buf[1] = static_cast<char>(COMMAND);
+  buf[2] = static_cast<char>(c.type);
+  buf[3] = 0;
+  for (int i = 0; i < 3; ++i) putDouble(buf + 4 + 8 * i, c.v[i]);
+  return CommandSize;
+}
+
+inline bool decodeCommand(const char *data, size_t size, command &c) {
+  if (size != CommandSize || !isBinary(data, size, COMMAND)) return false;
+  c.type = static_cast<uint8_t>(data[2]);
+  for (int i = 0; i < 3; ++i) c.v[i] = getDouble(data + 4 + 8 * i);
+  return c.type == CMD_RPM || c.type == CMD_VW;
+}
+}  // namespace cagewire
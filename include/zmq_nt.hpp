@@ -64,6 +64,11 @@
 
 #endif
 
+#if (__cplusplus >= 201703L) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define ZMQ_CPP17
+#include <string_view>
+#endif
+
 //  Detect whether the compiler supports C++11 rvalue references.
 #if (defined(__GNUC__) &&                                       \
      (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ > 2)) && \
@@ -121,6 +126,13 @@ namespace zmq {
 typedef zmq_free_fn    free_fn;
 typedef zmq_pollitem_t pollitem_t;
 
+// type of ZMQ_FD
+#ifdef _WIN32
+typedef SOCKET fd_t;
+#else
+typedef int fd_t;
+#endif
+
 #if 0
     class error_t : public std::exception
     {
@@ -370,11 +382,17 @@ public:
     return static_cast<T const *>(data());
   }
 
+#ifdef ZMQ_CPP17
+  // the bytes in place, valid until the message is received into, rebuilt,
+  // moved from or destroyed
+  inline std::string_view view() const ZMQ_NOTHROW {
+    return std::string_view(data<char>(), size());
+  }
+#endif
+
   inline bool equal(const message_t *other) const ZMQ_NOTHROW {
-    if (size() != other->size()) return false;
-    std::string a(data<char>(), size());
-    std::string b(other->data<char>(), other->size());
-    return a == b;
+    return size() == other->size() &&
+           (size() == 0 || memcmp(data(), other->data(), size()) == 0);
   }
 
 #if ZMQ_VERSION >= ZMQ_MAKE_VERSION(4, 1, 0)
@@ -480,7 +498,6 @@ enum class socket_type : int {
 
 class socket_t {
   friend class monitor_t;
-  friend class poller_t;
   bool valid = false;
 
 public:
@@ -882,59 +899,78 @@ private:
   void *monitor_socket;
 };
 
-#if defined(ZMQ_BUILD_DRAFT_API) && defined(ZMQ_CPP11) && \
-    defined(ZMQ_HAVE_POLLER)
+// Waits on up to N sockets (and plain file descriptors) at once with
+// zmq_poll; no draft API needed. The items live in a fixed array, so nothing
+// is allocated, and ready items are handed to a handler given to wait() as a
+// template argument: handler(index, revents), index being what add()
+// returned. Errors are returned as -errno like socket_t does; nothing
+// throws. The handler must not add or remove items.
+template <size_t N>
 class poller_t {
 public:
-  poller_t() : poller_ptr(zmq_poller_new()) {
-    if (!poller_ptr) throw error_t();
-  }
-
-  ~poller_t() { zmq_poller_destroy(&poller_ptr); }
-
-  bool add(zmq::socket_t &socket, short events,
-           std::function<void(void)> &handler) {
-    if (0 == zmq_poller_add(poller_ptr, socket.ptr, handler ? &handler : NULL,
-                            events)) {
-      poller_events.emplace_back(zmq_poller_event_t());
-      return true;
+  poller_t() : count(0) {}
+
+  // index of the new item, or -ENOSPC when all N are taken
+  int add(socket_t &socket, short events = ZMQ_POLLIN) {
+    return add_item(static_cast<void *>(socket), 0, events);
+  }
+  int add(fd_t fd, short events = ZMQ_POLLIN) {
+    return add_item(NULL, fd, events);
+  }
+  void modify(size_t index, short events) { items[index].events = events; }
+  // the last item takes the index of the removed one
+  void remove(size_t index) { items[index] = items[--count]; }
+  void clear() { count = 0; }
+
+  size_t size() const { return count; }
+  // events of item index found by the last wait()
+  short  revents(size_t index) const { return items[index].revents; }
+
+  // number of ready items, 0 on timeout, or -errno. timeout_ < 0 waits
+  // forever
+  int wait(long timeout_) {
+    int rc = zmq_poll(items, static_cast<int>(count), timeout_);
+    return rc < 0 ? -zmq_errno() : rc;
+  }
+
+  template <typename Handler>
+  int wait(long timeout_, Handler &&handler) {
+    int rc = wait(timeout_);
+    for (size_t i = 0, ready = 0; i < count && ready < size_t(rc > 0 ? rc : 0);
+         ++i) {
+      if (!items[i].revents) continue;
+      ++ready;
+      handler(i, items[i].revents);
     }
-    return false;
+    return rc;
   }
 
-  bool remove(zmq::socket_t &socket) {
-    if (0 == zmq_poller_remove(poller_ptr, socket.ptr)) {
-      poller_events.pop_back();
-      return true;
-    }
-    return false;
-  }
-
-  bool wait(std::chrono::milliseconds timeout) {
-    int rc = zmq_poller_wait_all(poller_ptr, poller_events.data(),
-                                 poller_events.size(),
-                                 static_cast<long>(timeout.count()));
-    if (rc >= 0) {
-      std::for_each(poller_events.begin(), poller_events.begin() + rc,
-                    [](zmq_poller_event_t &event) {
-                      if (event.user_data != NULL)
-                        (*reinterpret_cast<std::function<void(void)> *>(
-                            event.user_data))();
-                    });
-      return true;
-    }
-
-    if (zmq_errno() == ETIMEDOUT) return false;
+#ifdef ZMQ_CPP11
+  int wait(std::chrono::milliseconds timeout) {
+    return wait(static_cast<long>(timeout.count()));
+  }
 
-    throw error_t();
+  template <typename Handler>
+  int wait(std::chrono::milliseconds timeout, Handler &&handler) {
+    return wait(static_cast<long>(timeout.count()),
+                std::forward<Handler>(handler));
   }
+#endif
 
 private:
-  void *                          poller_ptr;
-  std::vector<zmq_poller_event_t> poller_events;
+  zmq_pollitem_t items[N];
+  size_t         count;
+
+  int add_item(void *socket, fd_t fd, short events) {
+    if (count == N) return -ENOSPC;
+    zmq_pollitem_t &item = items[count];
+    item.socket          = socket;
+    item.fd              = fd;
+    item.events          = events;
+    item.revents         = 0;
+    return static_cast<int>(count++);
+  }
 };
-#endif  //  defined(ZMQ_BUILD_DRAFT_API) && defined(ZMQ_CPP11) &&
-        //  defined(ZMQ_HAVE_POLLER)
 
 }  // namespace zmq
 
@@ -0,0 +1,198 @@
+// Copyright 2018-2020 Tomoaki Yoshida<yoshida@furo.org>
+/*
+This software is released under the MIT License.
+http://opensource.org/licenses/mit-license.php
+*/
+#include <signal.h>
+
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+#include "recorder.hh"
+#include "reportdecoder.hh"
+#include "subscriber.hh"
+#include "zmq_nt.hpp"
+
+namespace bo = boost::program_options;
+
+static std::atomic<bool> sTerminated{false};
+
+void sig_handler(int) { sTerminated = true; }
+
+int record(zmq::context_t &ctx, const std::string &server,
+           const std::vector<std::string> &actors, const std::string &path,
+           uint64_t limit) {
+  simSubscriber sub(ctx, "tcp://" + server + ":54321");
+  for (const auto &a : actors) sub.addTargetActor(a);
+  if (!sub.connect()) {
+    std::cerr << sub.getLastError() << std::endl;
+    return 1;
+  }
+  reportRecorder rec;
+  if (!rec.open(path)) {
+    std::cerr << rec.getLastError() << std::endl;
+    return 1;
+  }
+  zmq::message_t msg;
+  while (!sTerminated && (limit == 0 || rec.count() < limit)) {
+    if (!sub.recvRaw(msg)) continue;  // timed out
+    if (!sub.filterReport(msg.data<char>(), msg.size())) continue;
+    if (!rec.record(msg.data(), msg.size(), sub.lastTopic())) {
+      std::cerr << rec.getLastError() << std::endl;
+      break;
+    }
+  }
+  size_t n = rec.count();
+  if (!rec.close()) {
+    std::cerr << rec.getLastError() << std::endl;
+    return 1;
+  }
+  std::cout << n << " messages recorded to " << path << std::endl;
+  return 0;
+}
+
+int play(zmq::context_t &ctx, const std::string &path,
+         const std::string &bindAddr, double speed, bool loop) {
+  reportReplayer rep(ctx, bindAddr);
+  rep.setSpeed(speed);
+  rep.setLoop(loop);
+  if (!rep.open(path)) {
+    std::cerr << rep.getLastError() << std::endl;
+    return 1;
+  }
+  // give subscribers a moment to connect
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  auto     t0 = std::chrono::steady_clock::now();
+  uint64_t n  = rep.play(&sTerminated);
+  double   s =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+          .count();
+  if (rep.getLastError().size()) std::cerr << rep.getLastError() << std::endl;
+  std::cout << n << " messages in " << s << " s (" << n / s << " msg/s)"
+            << std::endl;
+  return 0;
+}
+
+int info(const std::string &path) {
+  reportLog log;
+  if (!log.open(path)) {
+    std::cerr << log.getLastError() << std::endl;
+    return 1;
+  }
+  std::cout << "records : " << log.size()
+            << (log.indexed() ? "" : " (no index, scanned)") << std::endl;
+  if (log.size() == 0) return 0;
+  std::cout << "start   : " << log.startTime() / 1000000000 << " (unix time)"
+            << std::endl
+            << "duration: " << log.at(log.size() - 1).t * 1e-9 << " s"
+            << std::endl;
+
+  // offline throughput of the decode path
+  uint64_t bytes = 0, decoded = 0;
+  auto     t0    = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < log.size(); ++i) {
+    auto         r = log.at(i);
+    reportFields f;
+    bytes += r.payload.size();
+    if (reportDecoder::decode(r.payload.data(), r.payload.size(), f))
+      ++decoded;
+  }
+  double s =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - t0)
+          .count();
+  std::cout << "payload : " << bytes << " bytes" << std::endl
+            << "decoded : " << decoded << " reports in " << s * 1e3 << " ms ("
+            << log.size() / s << " msg/s, " << bytes / s / 1e6 << " MB/s)"
+            << std::endl;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  signal(SIGINT, sig_handler);
+
+  std::string              server, path, bindAddr = "tcp://*:54321";
+  std::vector<std::string> actors;
+  double                   speed = 1;
+  uint64_t                 limit = 0;
+  bool                     loop  = false;
+  bo::options_description  options;
+  enum {
+    NONE,
+    RECORD,
+    PLAY,
+    INFO,
+  } Mode = NONE;
+
+  options.add_options()("help,h", "Print description")(
+      "record,r", bo::value<std::string>(), "Record reports to the file")(
+      "play,p", bo::value<std::string>(), "Publish reports in the file")(
+      "info,i", bo::value<std::string>(),
+      "Show summary and decode throughput of the file")(
+      "server,s", bo::value<std::string>(),
+      "Server address to record from (e.g. 127.0.0.1)")(
+      "actor,e", bo::value<std::vector<std::string>>(),
+      "Record only this actor (can be repeated)")(
+      "count,n", bo::value<uint64_t>(), "Stop recording after n messages")(
+      "bind,b", bo::value<std::string>(),
+      "Address to publish on (default: tcp://*:54321)")(
+      "speed", bo::value<double>(),
+      "Playback speed, 1 is real time, 0 is as fast as possible")(
+      "loop", "Repeat playback");
+
+  try {
+    bo::variables_map values;
+    bo::store(bo::parse_command_line(argc, argv, options), values);
+    bo::notify(values);
+
+    if (values.count("record")) {
+      Mode = RECORD;
+      path = values["record"].as<std::string>();
+    }
+    if (values.count("play")) {
+      Mode = PLAY;
+      path = values["play"].as<std::string>();
+    }
+    if (values.count("info")) {
+      Mode = INFO;
+      path = values["info"].as<std::string>();
+    }
+    if (values.count("server")) server = values["server"].as<std::string>();
+    if (values.count("actor"))
+      actors = values["actor"].as<std::vector<std::string>>();
+    if (values.count("count")) limit = values["count"].as<uint64_t>();
+    if (values.count("bind")) bindAddr = values["bind"].as<std::string>();
+    if (values.count("speed")) speed = values["speed"].as<double>();
+    if (values.count("loop")) loop = true;
+    if (values.count("help") || Mode == NONE) {
+      std::cout << "usage: cagelog -r [file] -s [address] | -p [file] | -i "
+                   "[file]"
+                << std::endl;
+      std::cout << options << std::endl;
+      return 0;
+    }
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return -1;
+  }
+
+  if (Mode == INFO) return info(path);
+
+  std::unique_ptr<zmq::context_t> ctx(new zmq::context_t(1));
+  if (!ctx->isValid()) {
+    std::cerr << "Cannot create zcontext:" << zmq_strerror(zmq_errno())
+              << std::endl;
+    exit(1);
+  }
+  if (Mode == PLAY) return play(*ctx, path, bindAddr, speed, loop);
+
+  if (server.size() == 0) {
+    std::cerr << "No server specified : " << server << std::endl;
+    exit(1);
+  }
+  return record(*ctx, server, actors, path, limit);
+}
@@ -10,6 +10,7 @@ http://opensource.org/licenses/mit-license.php
 #include <memory>
 #include <sstream>
 
+#include "cageclient.hh"
 #include "console.hh"
 #include "zmq_nt.hpp"
 
@@ -23,10 +24,15 @@ int main(int argc, char *argv[]) {
   enum {
     CONSOLE,
     LIST_ENDPOINT,
+    STATS,
   } Mode = CONSOLE;
+  int seconds = 0;
 
   options.add_options()("help,h", "Print description")(
       "endpoint,e", "Query endpoint tagged with specified sring")(
+      "stats", bo::value<int>(),
+      "Receive reports of the vehicle given as command for N seconds and "
+      "print latency statistics")(
       "server,s", bo::value<std::string>(),
       "Server address and port (e.g. 127.0.0.1:54323");
 
@@ -46,6 +52,10 @@ int main(int argc, char *argv[]) {
     if (values.count("endpoint")) {
       Mode = LIST_ENDPOINT;
     }
+    if (values.count("stats")) {
+      Mode    = STATS;
+      seconds = values["stats"].as<int>();
+    }
     if (values.count("help")) {
       std::cout << "usage: simconsole [options] [console command to exec]"
                 << std::endl;
@@ -62,6 +72,35 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  std::string cmdline;
+  for (const auto &arg : command) {
+    if (cmdline.size()) cmdline += " ";
+    cmdline = cmdline + arg;
+  }
+  if (Mode == STATS) {
+    // own context and sockets; reports of one vehicle (the first one if
+    // none is given) and one endpoint list request per second
+    CageAPI cage(server, cmdline);
+    cage.setLatencyStats(true);
+    if (!cage.connect()) {
+      std::cerr << cage.getErrorString() << std::endl;
+      exit(1);
+    }
+    auto next = std::chrono::steady_clock::now();
+    auto end  = next + std::chrono::seconds(seconds);
+    CageAPI::vehicleStatus vst;
+    while (std::chrono::steady_clock::now() < end) {
+      if (std::chrono::steady_clock::now() >= next) {
+        std::vector<std::string> res;
+        cage.getConsole().listEndpoints("Vehicle", res);
+        next += std::chrono::seconds(1);
+      }
+      cage.getStatusUntil(vst, std::min(end, next));
+    }
+    cage.getLatencyStats()->dump(std::cout);
+    return 0;
+  }
+
   std::unique_ptr<zmq::context_t> ctx(new zmq::context_t(1));
   if (!ctx) {
     std::cerr << "Cannot create zcontext:" << zmq_strerror(zmq_errno())
@@ -82,11 +121,6 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
-  std::string cmdline;
-  for (const auto &arg : command) {
-    if (cmdline.size()) cmdline += " ";
-    cmdline = cmdline + arg;
-  }
   switch (Mode) {
     case CONSOLE: {
       std::string res;
@@ -111,5 +145,7 @@ int main(int argc, char *argv[]) {
         }
       }
     } break;
+    default:
+      break;
   }
 }